@@ -2,8 +2,18 @@
 #include <list.h>
 #include <string.h>
 #include <stdio.h>
+#include "devices/elevator.h"
 #include "devices/ide.h"
+#include "devices/timer.h"
 #include "threads/malloc.h"
+#include "threads/thread.h"
+
+/* Most sectors the dispatch thread merges into one transfer. */
+#define MERGE_MAX 256
+
+/* Request latency histogram buckets: 0 ticks, 1, 2-3, 4-7, and so
+   on, with the last one open ended. */
+#define LATENCY_BUCKETS 8
 
 /* A block device. */
 struct block
@@ -19,6 +29,27 @@ struct block
 
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+
+    struct block *parent;               /* Device requests go to, if any. */
+    block_sector_t parent_start;        /* First sector within PARENT. */
+
+    struct list queue;                  /* Pending block_requests. */
+    struct lock queue_lock;             /* Protects queue and statistics. */
+    struct condition queue_cond;        /* Signaled when QUEUE fills. */
+    struct list active;                 /* Batches being transferred. */
+    bool synchronous;                   /* Transfer in block_submit(). */
+    int queue_depth;                    /* Most transfers at once. */
+    int dispatchers;                    /* Dispatch threads started. */
+    const struct elevator *elevator;    /* Orders QUEUE. */
+    block_sector_t head;                /* Sector after last transfer. */
+
+    /* Queue statistics. */
+    size_t depth;                       /* Requests in QUEUE. */
+    size_t max_depth;                   /* Most requests ever in QUEUE. */
+    unsigned long long depth_sum;       /* Sum of DEPTH seen by submits. */
+    unsigned long long request_cnt;     /* Requests submitted. */
+    unsigned long long merge_cnt;       /* Requests merged into others. */
+    unsigned long long latency[LATENCY_BUCKETS]; /* Ticks to complete. */
   };
 
 /* List of all block devices. */
@@ -27,7 +58,39 @@ static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 /* The block block assigned to each Pintos role. */
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
+/* I/O schedulers selectable with -iosched=, default first. */
+static const struct elevator *const elevators[] =
+  {
+    &elevator_deadline,
+    &elevator_clook,
+    &elevator_fifo,
+    NULL
+  };
+
+/* Schedulers chosen with -iosched= for devices not registered yet. */
+#define ELEVATOR_CHOICE_CNT 8
+static struct
+  {
+    char name[16];                      /* Block device name. */
+    const struct elevator *elevator;    /* Its scheduler. */
+  }
+elevator_choices[ELEVATOR_CHOICE_CNT];
+static size_t elevator_choice_cnt;
+
+/* Requests merged into one transfer by a dispatch thread. */
+struct batch
+  {
+    struct list_elem elem;              /* Element in block's active. */
+    struct list requests;               /* Merged block_requests. */
+  };
+
 static struct block *list_elem_to_block (struct list_elem *);
+static const struct elevator *chosen_elevator (const char *name);
+static void dispatch (void *block_);
+static void transfer (struct block *, bool write, block_sector_t sector,
+                      block_sector_t cnt, void *const bufs[]);
+static void complete (struct block_request *);
+static void record_latency (struct block *, int64_t submitted);
 
 /* Returns read_cnt of given block device */
 unsigned long long 
@@ -132,9 +195,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  block_read_multiple (block, sector, 1, &buffer);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -145,10 +206,415 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
-  check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  block_write_multiple (block, sector, 1, &buffer);
+}
+
+/* Reads CNT sectors starting at SECTOR from BLOCK, sector I into
+   BUFFERS[I], each of which must have room for BLOCK_SECTOR_SIZE
+   bytes.  Drivers that can move several sectors per command do so.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multiple (struct block *block, block_sector_t sector,
+                     block_sector_t cnt, void *const buffers[])
+{
+  struct block_request req;
+
+  if (cnt == 0)
+    return;
+  block_request_init (&req, false, sector, cnt, buffers, NULL, NULL);
+  block_submit (block, &req);
+  block_wait (&req);
+}
+
+/* Writes CNT sectors starting at SECTOR to BLOCK, sector I from
+   BUFFERS[I], each of which must contain BLOCK_SECTOR_SIZE bytes.
+   Returns after the block device has acknowledged receiving the
+   data.  Drivers that can move several sectors per command do so.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      block_sector_t cnt, const void *const buffers[])
+{
+  struct block_request req;
+
+  if (cnt == 0)
+    return;
+  block_request_init (&req, true, sector, cnt, (void *const *) buffers,
+                      NULL, NULL);
+  block_submit (block, &req);
+  block_wait (&req);
+}
+
+/* Initializes REQ to read CNT sectors starting at SECTOR into
+   BUFFERS, or to write them from BUFFERS if WRITE is true.  DONE,
+   if non-null, is called with REQ when it completes, and may use
+   AUX. */
+void
+block_request_init (struct block_request *req, bool write,
+                    block_sector_t sector, block_sector_t cnt,
+                    void *const buffers[],
+                    void (*done) (struct block_request *), void *aux)
+{
+  req->write = write;
+  req->sector = sector;
+  req->cnt = cnt;
+  req->buffers = buffers;
+  req->done = done;
+  req->aux = aux;
+  sema_init (&req->completed, 0);
+}
+
+/* Queues REQ on BLOCK and returns without waiting for it.  A
+   request to a partition is queued on the device holding it, with
+   REQ's sector translated to that device.  A synchronous device
+   carries REQ out right away instead, in the caller's thread.
+   Panics if REQ reaches past the end of BLOCK. */
+void
+block_submit (struct block *block, struct block_request *req)
+{
+  ASSERT (req->cnt > 0);
+  check_sector (block, req->sector);
+  check_sector (block, req->sector + req->cnt - 1);
+  if (req->write)
+    {
+      ASSERT (block->type != BLOCK_FOREIGN);
+      block->write_cnt += req->cnt;
+    }
+  else
+    block->read_cnt += req->cnt;
+
+  if (block->parent != NULL)
+    {
+      req->sector += block->parent_start;
+      block_submit (block->parent, req);
+      return;
+    }
+
+  if (block->synchronous)
+    {
+      req->submitted = timer_ticks ();
+      transfer (block, req->write, req->sector, req->cnt, req->buffers);
+      lock_acquire (&block->queue_lock);
+      block->request_cnt++;
+      record_latency (block, req->submitted);
+      lock_release (&block->queue_lock);
+      complete (req);
+      return;
+    }
+
+  lock_acquire (&block->queue_lock);
+  req->submitted = timer_ticks ();
+  block->request_cnt++;
+  block->depth++;
+  block->depth_sum += block->depth;
+  if (block->depth > block->max_depth)
+    block->max_depth = block->depth;
+  while (block->dispatchers < block->queue_depth)
+    {
+      char name[sizeof block->name + 3];
+      snprintf (name, sizeof name, "%s-io", block->name);
+      if (thread_create (name, PRI_DEFAULT, dispatch, block) == TID_ERROR)
+        PANIC ("Failed to create dispatch thread for %s", block->name);
+      block->dispatchers++;
+    }
+  list_push_back (&block->queue, &req->elem);
+  cond_signal (&block->queue_cond, &block->queue_lock);
+  lock_release (&block->queue_lock);
+}
+
+/* Waits for REQ, which must have been submitted without a
+   completion callback, to complete. */
+void
+block_wait (struct block_request *req)
+{
+  ASSERT (req->done == NULL);
+  sema_down (&req->completed);
+}
+
+/* Returns true if A and B are for overlapping sectors and at
+   least one of them writes, so that they must be carried out in
+   the order they were submitted. */
+static bool
+conflicts (const struct block_request *a, const struct block_request *b)
+{
+  return ((a->write || b->write)
+          && a->sector < b->sector + b->cnt
+          && b->sector < a->sector + a->cnt);
+}
+
+/* Returns the earliest request queued on BLOCK before REQ that
+   conflicts with REQ, or a null pointer if there is none. */
+static struct block_request *
+first_conflict (struct block *block, struct block_request *req)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&block->queue); e != &req->elem; e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (conflicts (r, req))
+        return r;
+    }
+  return NULL;
+}
+
+/* Returns true if REQ conflicts with a request in a transfer that
+   another of BLOCK's dispatch threads is carrying out. */
+static bool
+conflicts_active (struct block *block, struct block_request *req)
+{
+  struct list_elem *e, *f;
+
+  for (e = list_begin (&block->active); e != list_end (&block->active);
+       e = list_next (e))
+    {
+      struct batch *b = list_entry (e, struct batch, elem);
+      for (f = list_begin (&b->requests); f != list_end (&b->requests);
+           f = list_next (f))
+        if (conflicts (list_entry (f, struct block_request, elem), req))
+          return true;
+    }
+  return false;
+}
+
+/* Returns true if REQ may be carried out now, without passing a
+   conflicting request that is queued before it or in transfer. */
+static bool
+ready (struct block *block, struct block_request *req)
+{
+  return (first_conflict (block, req) == NULL
+          && !conflicts_active (block, req));
+}
+
+/* Removes from BLOCK's queue the request its elevator picks,
+   together with the queued requests for the sectors just before
+   and after it in the same direction, up to MERGE_MAX sectors in
+   all, and moves them into BATCH in sector order.  Requests that
+   would pass a conflicting earlier request stay queued, and if
+   the picked one must wait for a transfer in progress, the oldest
+   request that need not wait is taken instead.  Sets *SECTOR and
+   *CNT to the sectors the batch covers.  Returns false, taking
+   nothing, if every queued request must wait.  BLOCK's queue lock
+   must be held and its queue must not be empty. */
+static bool
+take_batch (struct block *block, struct list *batch,
+            block_sector_t *sector, block_sector_t *cnt)
+{
+  struct block_request *req, *c;
+  bool merged;
+
+  req = block->elevator->next (&block->queue, block->head, timer_ticks ());
+  while ((c = first_conflict (block, req)) != NULL)
+    req = c;
+  if (conflicts_active (block, req))
+    {
+      struct list_elem *e;
+
+      req = NULL;
+      for (e = list_begin (&block->queue); e != list_end (&block->queue);
+           e = list_next (e))
+        {
+          struct block_request *r = list_entry (e, struct block_request,
+                                                elem);
+          if (ready (block, r))
+            {
+              req = r;
+              break;
+            }
+        }
+      if (req == NULL)
+        return false;
+    }
+  list_remove (&req->elem);
+  list_push_back (batch, &req->elem);
+  *sector = req->sector;
+  *cnt = req->cnt;
+
+  do
+    {
+      struct list_elem *e;
+
+      merged = false;
+      for (e = list_begin (&block->queue); e != list_end (&block->queue);
+           e = list_next (e))
+        {
+          struct block_request *r = list_entry (e, struct block_request,
+                                                elem);
+          if (r->write != req->write || *cnt + r->cnt > MERGE_MAX
+              || !ready (block, r))
+            continue;
+          if (r->sector == *sector + *cnt)
+            {
+              list_remove (&r->elem);
+              list_push_back (batch, &r->elem);
+            }
+          else if (r->sector + r->cnt == *sector)
+            {
+              list_remove (&r->elem);
+              list_push_front (batch, &r->elem);
+              *sector = r->sector;
+            }
+          else
+            continue;
+          *cnt += r->cnt;
+          block->merge_cnt++;
+          merged = true;
+          break;
+        }
+    }
+  while (merged);
+  return true;
+}
+
+/* Records in BLOCK's statistics that a request submitted at tick
+   SUBMITTED has completed. */
+static void
+record_latency (struct block *block, int64_t submitted)
+{
+  int64_t ticks = timer_elapsed (submitted);
+  int bucket = 0;
+
+  while (ticks > 0 && bucket < LATENCY_BUCKETS - 1)
+    {
+      ticks >>= 1;
+      bucket++;
+    }
+  block->latency[bucket]++;
+}
+
+/* Transfers the CNT sectors from SECTOR on of BLOCK to or from
+   BUFS with BLOCK's driver, in as few calls as it allows. */
+static void
+transfer (struct block *block, bool write, block_sector_t sector,
+          block_sector_t cnt, void *const bufs[])
+{
+  block_sector_t i;
+
+  if (write && block->ops->write_multiple != NULL)
+    block->ops->write_multiple (block->aux, sector, cnt,
+                                (const void *const *) bufs);
+  else if (write)
+    for (i = 0; i < cnt; i++)
+      block->ops->write (block->aux, sector + i, bufs[i]);
+  else if (block->ops->read_multiple != NULL)
+    block->ops->read_multiple (block->aux, sector, cnt, bufs);
+  else
+    for (i = 0; i < cnt; i++)
+      block->ops->read (block->aux, sector + i, bufs[i]);
+}
+
+/* Tells REQ's submitter that REQ has completed. */
+static void
+complete (struct block_request *req)
+{
+  if (req->done != NULL)
+    req->done (req);
+  else
+    sema_up (&req->completed);
+}
+
+/* Dispatch thread of BLOCK_: carries out BLOCK_'s queued requests
+   in the order its elevator picks, each merged with the requests
+   for adjacent sectors into a single transfer.  A device with a
+   queue depth above 1 has that many dispatch threads, each with
+   its own transfer outstanding. */
+static void
+dispatch (void *block_)
+{
+  struct block *block = block_;
+  void **buffers = malloc (MERGE_MAX * sizeof *buffers);
+
+  if (buffers == NULL)
+    PANIC ("Failed to allocate memory for %s dispatch", block->name);
+
+  for (;;)
+    {
+      struct batch batch;
+      struct list_elem *e;
+      struct block_request *req;
+      block_sector_t sector, cnt, i;
+      void *const *bufs;
+      bool write;
+
+      list_init (&batch.requests);
+      lock_acquire (&block->queue_lock);
+      while (list_empty (&block->queue)
+             || !take_batch (block, &batch.requests, &sector, &cnt))
+        cond_wait (&block->queue_cond, &block->queue_lock);
+      block->depth -= list_size (&batch.requests);
+      list_push_back (&block->active, &batch.elem);
+      lock_release (&block->queue_lock);
+
+      /* Gather the buffers of merged requests. */
+      req = list_entry (list_front (&batch.requests), struct block_request,
+                        elem);
+      write = req->write;
+      bufs = req->buffers;
+      if (list_size (&batch.requests) > 1)
+        {
+          i = 0;
+          for (e = list_begin (&batch.requests);
+               e != list_end (&batch.requests); e = list_next (e))
+            {
+              struct block_request *r = list_entry (e, struct block_request,
+                                                    elem);
+              memcpy (buffers + i, r->buffers, r->cnt * sizeof *buffers);
+              i += r->cnt;
+            }
+          bufs = buffers;
+        }
+
+      transfer (block, write, sector, cnt, bufs);
+
+      /* Let other dispatch threads take requests that had to wait
+         for this transfer. */
+      lock_acquire (&block->queue_lock);
+      block->head = sector + cnt;
+      list_remove (&batch.elem);
+      for (e = list_begin (&batch.requests); e != list_end (&batch.requests);
+           e = list_next (e))
+        record_latency (block,
+                        list_entry (e, struct block_request, elem)->submitted);
+      if (block->queue_depth > 1)
+        cond_broadcast (&block->queue_cond, &block->queue_lock);
+      lock_release (&block->queue_lock);
+
+      while (!list_empty (&batch.requests))
+        {
+          req = list_entry (list_pop_front (&batch.requests),
+                            struct block_request, elem);
+          complete (req);
+        }
+    }
+}
+
+/* Selects the I/O scheduler for a block device as SPEC, in the form
+   DEV:SCHED, says.  Must be called before DEV is registered.
+   Returns false if SPEC is malformed or names no scheduler. */
+bool
+block_select_elevator (const char *spec)
+{
+  const struct elevator *const *e;
+  const char *colon = strchr (spec, ':');
+  size_t name_len;
+
+  if (colon == NULL || elevator_choice_cnt >= ELEVATOR_CHOICE_CNT)
+    return false;
+  name_len = colon - spec;
+  if (name_len == 0 || name_len >= sizeof elevator_choices[0].name)
+    return false;
+  for (e = elevators; *e != NULL; e++)
+    if (!strcmp ((*e)->name, colon + 1))
+      {
+        memcpy (elevator_choices[elevator_choice_cnt].name, spec, name_len);
+        elevator_choices[elevator_choice_cnt].name[name_len] = '\0';
+        elevator_choices[elevator_choice_cnt].elevator = *e;
+        elevator_choice_cnt++;
+        return true;
+      }
+  return false;
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -172,10 +638,16 @@ block_type (struct block *block)
   return block->type;
 }
 
-/* Prints statistics for each block device used for a Pintos role. */
+/* Prints statistics for each block device used for a Pintos role,
+   then request queue statistics for each device that carried out
+   requests: the average and largest queue depth seen by a new
+   request, how many requests were merged into another one's
+   transfer, and a histogram of ticks from submission to
+   completion. */
 void
 block_print_stats (void)
 {
+  struct list_elem *e;
   int i;
 
   for (i = 0; i < BLOCK_ROLE_CNT; i++)
@@ -188,6 +660,31 @@ block_print_stats (void)
                   block->read_cnt, block->write_cnt);
         }
     }
+
+  for (e = list_begin (&all_blocks); e != list_end (&all_blocks);
+       e = list_next (e))
+    {
+      struct block *block = list_entry (e, struct block, list_elem);
+      if (block->request_cnt == 0)
+        continue;
+      printf ("%s queue (%s): %llu requests, depth avg %llu max %zu, "
+              "%llu merged (%llu%%)\n",
+              block->name, block->elevator->name, block->request_cnt,
+              block->depth_sum / block->request_cnt, block->max_depth,
+              block->merge_cnt, block->merge_cnt * 100 / block->request_cnt);
+      printf ("%s latency (ticks):", block->name);
+      for (i = 0; i < LATENCY_BUCKETS; i++)
+        if (i == 0)
+          printf (" 0: %llu", block->latency[i]);
+        else if (i == LATENCY_BUCKETS - 1)
+          printf (", %d+: %llu", 1 << (i - 1), block->latency[i]);
+        else if (i == 1)
+          printf (", 1: %llu", block->latency[i]);
+        else
+          printf (", %d-%d: %llu", 1 << (i - 1), (1 << i) - 1,
+                  block->latency[i]);
+      printf ("\n");
+    }
 }
 
 /* Registers a new block device with the given NAME.  If
@@ -201,6 +698,8 @@ block_register (const char *name, enum block_type type,
                 const struct block_operations *ops, void *aux)
 {
   struct block *block = malloc (sizeof *block);
+  size_t i;
+
   if (block == NULL)
     PANIC ("Failed to allocate memory for block device descriptor");
 
@@ -212,6 +711,23 @@ block_register (const char *name, enum block_type type,
   block->aux = aux;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  block->parent = NULL;
+  block->parent_start = 0;
+  list_init (&block->queue);
+  lock_init (&block->queue_lock);
+  cond_init (&block->queue_cond);
+  list_init (&block->active);
+  block->synchronous = false;
+  block->queue_depth = 1;
+  block->dispatchers = 0;
+  block->elevator = chosen_elevator (name);
+  if (block->elevator == NULL)
+    block->elevator = elevators[0];
+  block->head = 0;
+  block->depth = block->max_depth = 0;
+  block->depth_sum = block->request_cnt = block->merge_cnt = 0;
+  for (i = 0; i < LATENCY_BUCKETS; i++)
+    block->latency[i] = 0;
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
@@ -223,6 +739,71 @@ block_register (const char *name, enum block_type type,
   return block;
 }
 
+/* Makes BLOCK, a partition of PARENT starting at sector START,
+   pass its requests on to PARENT, so that they are queued and
+   scheduled together with PARENT's own.  A scheduler chosen for
+   BLOCK therefore goes to PARENT, unless PARENT has its own. */
+void
+block_set_parent (struct block *block, struct block *parent,
+                  block_sector_t start)
+{
+  const struct elevator *e = chosen_elevator (block->name);
+
+  block->parent = parent;
+  block->parent_start = start;
+  if (e == NULL)
+    return;
+  if (chosen_elevator (parent->name) != NULL)
+    {
+      if (e != parent->elevator)
+        printf ("%s: ignoring -iosched=%s:%s, %s has its own scheduler\n",
+                block->name, block->name, e->name, parent->name);
+      return;
+    }
+  lock_acquire (&parent->queue_lock);
+  parent->elevator = e;
+  lock_release (&parent->queue_lock);
+  printf ("%s: %s scheduler, as chosen for partition %s\n",
+          parent->name, e->name, block->name);
+}
+
+/* Returns the scheduler chosen with -iosched= for the device
+   called NAME, the last one if several were, or a null pointer. */
+static const struct elevator *
+chosen_elevator (const char *name)
+{
+  const struct elevator *e = NULL;
+  size_t i;
+
+  for (i = 0; i < elevator_choice_cnt; i++)
+    if (!strcmp (elevator_choices[i].name, name))
+      e = elevator_choices[i].elevator;
+  return e;
+}
+
+/* Lets BLOCK's driver carry out up to DEPTH transfers at once,
+   each called from its own dispatch thread, for devices that can
+   keep several commands in flight.  Must be called before any
+   request is submitted to BLOCK. */
+void
+block_set_queue_depth (struct block *block, int depth)
+{
+  ASSERT (depth > 0);
+  ASSERT (block->dispatchers == 0);
+  block->queue_depth = depth;
+}
+
+/* Makes block_submit() call BLOCK's driver directly instead of
+   queuing requests for a dispatch thread, for devices such as a
+   RAM disk whose transfers finish as soon as they start, so that
+   scheduling and a thread switch would only add to their cost. */
+void
+block_set_synchronous (struct block *block)
+{
+  ASSERT (block->dispatchers == 0);
+  block->synchronous = true;
+}
+
 /* Returns the block device corresponding to LIST_ELEM, or a null
    pointer if LIST_ELEM is the list end of all_blocks. */
 static struct block *
@@ -1,8 +1,11 @@
 #ifndef DEVICES_BLOCK_H
 #define DEVICES_BLOCK_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <inttypes.h>
+#include <list.h>
+#include "threads/synch.h"
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -56,9 +59,46 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, block_sector_t cnt,
+                          void *const buffers[]);
+void block_write_multiple (struct block *, block_sector_t, block_sector_t cnt,
+                           const void *const buffers[]);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* Asynchronous requests.
+
+   A request moves CNT consecutive sectors starting at SECTOR, each
+   to or from its own buffer.  It is queued on its device and carried
+   out by one of the device's dispatch threads, so block_submit()
+   returns at once.  On completion DONE is called from that thread, if
+   it is non-null, or else the request's semaphore is up'd for
+   block_wait().  The request must stay allocated until then.  A
+   synchronous device carries the request out, and completes it,
+   before block_submit() returns. */
+struct block_request
+  {
+    struct list_elem elem;              /* Element in device queue. */
+    bool write;                         /* Write rather than read? */
+    block_sector_t sector;              /* First sector. */
+    block_sector_t cnt;                 /* Number of sectors. */
+    void *const *buffers;               /* CNT sector buffers. */
+    void (*done) (struct block_request *); /* Completion callback. */
+    void *aux;                          /* For DONE's use. */
+    struct semaphore completed;         /* Up'd on completion. */
+    int64_t submitted;                  /* Timer tick of submission. */
+  };
+
+void block_request_init (struct block_request *, bool write,
+                         block_sector_t sector, block_sector_t cnt,
+                         void *const buffers[],
+                         void (*done) (struct block_request *), void *aux);
+void block_submit (struct block *, struct block_request *);
+void block_wait (struct block_request *);
+
+/* Request scheduling. */
+bool block_select_elevator (const char *spec);
+
 /* Statistics. */
 void block_print_stats (void);
 
@@ -68,10 +108,22 @@ struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Transfer CNT consecutive sectors, each to or from its own
+       buffer, as few commands as the device allows.  Optional: if
+       null, the block layer calls read or write for each sector. */
+    void (*read_multiple) (void *aux, block_sector_t, block_sector_t cnt,
+                           void *const buffers[]);
+    void (*write_multiple) (void *aux, block_sector_t, block_sector_t cnt,
+                            const void *const buffers[]);
   };
 
 struct block *block_register (const char *name, enum block_type,
                               const char *extra_info, block_sector_t size,
                               const struct block_operations *, void *aux);
+void block_set_parent (struct block *, struct block *parent,
+                       block_sector_t start);
+void block_set_queue_depth (struct block *, int depth);
+void block_set_synchronous (struct block *);
 
 #endif /* devices/block.h */
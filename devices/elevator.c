@@ -0,0 +1,58 @@
+#include "devices/elevator.h"
+#include <debug.h>
+#include "devices/timer.h"
+
+/* Ticks a read, or a write, may wait before the deadline
+   scheduler serves it ahead of requests closer to the head. */
+#define READ_EXPIRE (TIMER_FREQ / 20)
+#define WRITE_EXPIRE (TIMER_FREQ / 2)
+
+/* First come, first served. */
+static struct block_request *
+fifo_next (struct list *queue, block_sector_t head UNUSED,
+           int64_t now UNUSED)
+{
+  return list_entry (list_front (queue), struct block_request, elem);
+}
+
+const struct elevator elevator_fifo = {"fifo", fifo_next};
+
+/* C-LOOK: serves requests in ascending sector order from the
+   head, then goes back to the lowest sector and sweeps again. */
+static struct block_request *
+clook_next (struct list *queue, block_sector_t head, int64_t now UNUSED)
+{
+  struct block_request *ahead = NULL, *lowest = NULL;
+  struct list_elem *e;
+
+  for (e = list_begin (queue); e != list_end (queue); e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (r->sector >= head && (ahead == NULL || r->sector < ahead->sector))
+        ahead = r;
+      if (lowest == NULL || r->sector < lowest->sector)
+        lowest = r;
+    }
+  return ahead != NULL ? ahead : lowest;
+}
+
+const struct elevator elevator_clook = {"clook", clook_next};
+
+/* Deadline: C-LOOK, except that the oldest request that has waited
+   longer than its expiry time, shorter for reads since a thread
+   usually waits for those, goes first. */
+static struct block_request *
+deadline_next (struct list *queue, block_sector_t head, int64_t now)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (queue); e != list_end (queue); e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (now - r->submitted > (r->write ? WRITE_EXPIRE : READ_EXPIRE))
+        return r;
+    }
+  return clook_next (queue, head, now);
+}
+
+const struct elevator elevator_deadline = {"deadline", deadline_next};
@@ -0,0 +1,30 @@
+#ifndef DEVICES_ELEVATOR_H
+#define DEVICES_ELEVATOR_H
+
+#include <list.h>
+#include <stdint.h>
+#include "devices/block.h"
+
+/* An I/O scheduler, which decides in what order a block device
+   carries out its queued requests.  Called with the device's
+   queue lock held, so a scheduler needs no locking of its own.
+   The block layer merges the chosen request with adjacent ones
+   and never lets it pass an earlier request for the same
+   sectors, so a scheduler only has to pick. */
+struct elevator
+  {
+    const char *name;           /* Name for -iosched= option. */
+
+    /* Returns, without removing it, the request of QUEUE, a
+       non-empty list of block_requests in submission order, to
+       carry out next.  HEAD is the sector following the last one
+       transferred and NOW the current timer tick. */
+    struct block_request *(*next) (struct list *queue, block_sector_t head,
+                                   int64_t now);
+  };
+
+extern const struct elevator elevator_fifo;
+extern const struct elevator elevator_clook;
+extern const struct elevator elevator_deadline;
+
+#endif /* devices/elevator.h */
@@ -5,10 +5,13 @@
 #include <stdio.h>
 #include "devices/block.h"
 #include "devices/partition.h"
+#include "devices/pci.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
    controller.  It attempts to comply to [ATA-3]. */
@@ -30,10 +33,36 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus master IDE port addresses, relative to the base that the
+   controller's PCI BAR 4 gives, plus 8 for the secondary channel.
+   See [IDE-BM]. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)    /* PRD table. */
+
+/* Bus master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+#define BM_CMD_TO_MEMORY 0x08   /* Transfer from disk to memory. */
+
+/* Bus master Status Register bits.  Written as 1 to clear. */
+#define BM_STA_ERR 0x02         /* Transfer failed. */
+#define BM_STA_INTR 0x04        /* Disk interrupted. */
+
+/* A physical region descriptor: one physically contiguous piece
+   of memory, not crossing a 64 kB boundary, for a DMA transfer. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address. */
+    uint16_t size;              /* Size in bytes. */
+    uint16_t flags;             /* PRD_EOT on the last descriptor. */
+  };
+#define PRD_EOT 0x8000          /* Last descriptor of the table. */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +78,15 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Most sectors one command can transfer: a sector count register
+   of 0 means 256. */
+#define MAX_CMD_SECTORS 256
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +95,9 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    int multiple;               /* Sectors per READ/WRITE MULTIPLE
+                                   data block, 0 if unsupported. */
+    bool dma;                   /* Transfer data by bus master DMA? */
   };
 
 /* An ATA channel (aka controller).
@@ -72,6 +113,9 @@ struct channel
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus master base I/O port, 0 if none. */
+    struct prd *prd;            /* PRD table, one page, if DMA is used. */
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
@@ -81,14 +125,25 @@ static struct channel channels[CHANNEL_CNT];
 
 static struct block_operations ide_operations;
 
+/* -ide-dma: Transfer data by bus master DMA where possible? */
+bool ide_dma;
+
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sector (struct ata_disk *, block_sector_t,
+                           block_sector_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
+static void dma_transfer (struct ata_disk *, block_sector_t,
+                          block_sector_t cnt, void *const buffers[],
+                          bool write);
+static void ide_read_multiple (void *, block_sector_t, block_sector_t cnt,
+                               void *const buffers[]);
+static void ide_write_multiple (void *, block_sector_t, block_sector_t cnt,
+                                const void *const buffers[]);
 
 static void wait_until_idle (const struct ata_disk *);
 static bool wait_while_busy (const struct ata_disk *);
@@ -102,6 +157,18 @@ void
 ide_init (void) 
 {
   size_t chan_no;
+  uint16_t bm_base = 0;
+
+  /* Find the bus master IDE controller, if DMA was asked for. */
+  if (ide_dma)
+    {
+      struct pci_dev pci;
+      if (pci_find_class (0x01, 0x01, &pci)
+          && (bm_base = pci_io_bar (&pci, 4)) != 0)
+        pci_enable (&pci, PCI_CMD_IO | PCI_CMD_MASTER);
+      else
+        printf ("ide: no bus master IDE controller, using PIO\n");
+    }
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
     {
@@ -126,6 +193,8 @@ ide_init (void)
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->bm_base = bm_base != 0 ? bm_base + chan_no * 8 : 0;
+      c->prd = NULL;
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +205,8 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple = 0;
+          d->dma = false;
         }
 
       /* Register interrupt handler. */
@@ -158,6 +229,7 @@ ide_init (void)
 /* Disk detection and identification. */
 
 static char *descramble_ata_string (char *, int size);
+static void set_multiple_mode (struct ata_disk *, const char id[]);
 
 /* Resets an ATA channel and waits for any devices present on it
    to finish the reset. */
@@ -280,6 +352,16 @@ identify_ata_device (struct ata_disk *d)
       return;
     }
   input_sector (c, id);
+  set_multiple_mode (d, id);
+
+  /* Use DMA if the channel has a bus master and the disk supports
+     it (word 49, bit 8). */
+  if (c->bm_base != 0 && (*(uint16_t *) &id[49 * 2] & 0x100))
+    {
+      if (c->prd == NULL)
+        c->prd = palloc_get_page (0);
+      d->dma = c->prd != NULL;
+    }
 
   /* Calculate capacity.
      Read model name and serial number. */
@@ -287,7 +369,8 @@ identify_ata_device (struct ata_disk *d)
   model = descramble_ata_string (&id[10 * 2], 20);
   serial = descramble_ata_string (&id[27 * 2], 40);
   snprintf (extra_info, sizeof extra_info,
-            "model \"%s\", serial \"%s\"", model, serial);
+            "model \"%s\", serial \"%s\"%s", model, serial,
+            d->dma ? ", DMA" : "");
 
   /* Disable access to IDE disks over 1 GB, which are likely
      physical IDE disks rather than virtual ones.  If we don't
@@ -309,6 +392,28 @@ identify_ata_device (struct ata_disk *d)
   partition_scan (block);
 }
 
+/* Enables READ/WRITE MULTIPLE on disk D with the largest data
+   block its IDENTIFY DEVICE response ID allows, and records the
+   block size in D.  Leaves D's multiple at 0 if the disk does not
+   support it. */
+static void
+set_multiple_mode (struct ata_disk *d, const char id[])
+{
+  struct channel *c = d->channel;
+  int multiple = *(const uint16_t *) &id[47 * 2] & 0xff;
+
+  if (multiple == 0)
+    return;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), multiple);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if ((inb (reg_status (c)) & STA_ERR) == 0)
+    d->multiple = multiple;
+}
+
 /* Translates STRING, which consists of SIZE bytes in a funky
    format, into a null-terminated string in-place.  Drops
    trailing whitespace and null bytes.  Returns STRING.  */
@@ -346,8 +451,13 @@ ide_read (void *d_, block_sector_t sec_no, void *buffer)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  if (d->dma)
+    {
+      ide_read_multiple (d, sec_no, 1, &buffer);
+      return;
+    }
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
+  select_sector (d, sec_no, 1);
   issue_pio_command (c, CMD_READ_SECTOR_RETRY);
   sema_down (&c->completion_wait);
   if (!wait_while_busy (d))
@@ -366,8 +476,13 @@ ide_write (void *d_, block_sector_t sec_no, const void *buffer)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  if (d->dma)
+    {
+      ide_write_multiple (d, sec_no, 1, &buffer);
+      return;
+    }
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
+  select_sector (d, sec_no, 1);
   issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
   if (!wait_while_busy (d))
     PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
@@ -376,24 +491,121 @@ ide_write (void *d_, block_sector_t sec_no, const void *buffer)
   lock_release (&c->lock);
 }
 
+/* Reads CNT sectors starting at SEC_NO from disk D, sector I into
+   BUFFERS[I], each of which must have room for BLOCK_SECTOR_SIZE
+   bytes.  Issues one command per MAX_CMD_SECTORS sectors: READ DMA
+   if D uses DMA, so that the CPU is free until the disk interrupts
+   at the end, otherwise READ MULTIPLE if D supports it, so that
+   the disk interrupts once per data block rather than once per
+   sector.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_read_multiple (void *d_, block_sector_t sec_no, block_sector_t cnt,
+                   void *const buffers[])
+{
+  struct ata_disk *d = d_;
+  struct channel *c = d->channel;
+  block_sector_t per_block = d->multiple > 0 ? d->multiple : 1;
+  lock_acquire (&c->lock);
+  while (cnt > 0)
+    {
+      block_sector_t cmd_cnt = cnt < MAX_CMD_SECTORS ? cnt : MAX_CMD_SECTORS;
+      block_sector_t i;
+
+      if (d->dma)
+        {
+          dma_transfer (d, sec_no, cmd_cnt, buffers, false);
+          goto next;
+        }
+      select_sector (d, sec_no, cmd_cnt);
+      issue_pio_command (c, d->multiple > 0 ? CMD_READ_MULTIPLE
+                                            : CMD_READ_SECTOR_RETRY);
+      for (i = 0; i < cmd_cnt; i++)
+        {
+          if (i % per_block == 0)
+            {
+              sema_down (&c->completion_wait);
+              if (!wait_while_busy (d))
+                PANIC ("%s: disk read failed, sector=%"PRDSNu,
+                       d->name, sec_no + i);
+            }
+          input_sector (c, buffers[i]);
+        }
+    next:
+      sec_no += cmd_cnt;
+      buffers += cmd_cnt;
+      cnt -= cmd_cnt;
+    }
+  lock_release (&c->lock);
+}
+
+/* Writes CNT sectors starting at SEC_NO to disk D, sector I from
+   BUFFERS[I], each of which must contain BLOCK_SECTOR_SIZE bytes.
+   Returns after the disk has acknowledged receiving the data.
+   Issues commands as ide_read_multiple().
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_write_multiple (void *d_, block_sector_t sec_no, block_sector_t cnt,
+                    const void *const buffers[])
+{
+  struct ata_disk *d = d_;
+  struct channel *c = d->channel;
+  block_sector_t per_block = d->multiple > 0 ? d->multiple : 1;
+  lock_acquire (&c->lock);
+  while (cnt > 0)
+    {
+      block_sector_t cmd_cnt = cnt < MAX_CMD_SECTORS ? cnt : MAX_CMD_SECTORS;
+      block_sector_t i;
+
+      if (d->dma)
+        {
+          dma_transfer (d, sec_no, cmd_cnt, (void *const *) buffers, true);
+          goto next;
+        }
+      select_sector (d, sec_no, cmd_cnt);
+      issue_pio_command (c, d->multiple > 0 ? CMD_WRITE_MULTIPLE
+                                            : CMD_WRITE_SECTOR_RETRY);
+      for (i = 0; i < cmd_cnt; i++)
+        {
+          if (i % per_block == 0 && !wait_while_busy (d))
+            PANIC ("%s: disk write failed, sector=%"PRDSNu,
+                   d->name, sec_no + i);
+          output_sector (c, buffers[i]);
+          if (i % per_block == per_block - 1 || i == cmd_cnt - 1)
+            sema_down (&c->completion_wait);
+        }
+    next:
+      sec_no += cmd_cnt;
+      buffers += cmd_cnt;
+      cnt -= cmd_cnt;
+    }
+  lock_release (&c->lock);
+}
+
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multiple,
+    ide_write_multiple
   };
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
+   writes SEC_NO and the number of sectors CNT, at most
+   MAX_CMD_SECTORS, to the disk's sector selection registers.  (We
    use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, block_sector_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_CMD_SECTORS);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt % MAX_CMD_SECTORS);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -401,8 +613,8 @@ select_sector (struct ata_disk *d, block_sector_t sec_no)
         DEV_MBS | DEV_LBA | (d->dev_no == 1 ? DEV_DEV : 0) | (sec_no >> 24));
 }
 
-/* Writes COMMAND to channel C and prepares for receiving a
-   completion interrupt. */
+/* Writes COMMAND, a PIO or DMA command, to channel C and prepares
+   for receiving a completion interrupt. */
 static void
 issue_pio_command (struct channel *c, uint8_t command) 
 {
@@ -429,6 +641,78 @@ output_sector (struct channel *c, const void *sector)
 {
   outsw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
 }
+
+/* Appends descriptors for the BLOCK_SECTOR_SIZE bytes at BUFFER,
+   a kernel virtual address, to the CNT descriptors in PRD, and
+   returns the new count.  Extends the last descriptor if BUFFER
+   follows it physically, and splits BUFFER at a 64 kB boundary,
+   so each sector takes at most two descriptors. */
+static size_t
+add_prd (struct prd *prd, size_t cnt, const void *buffer)
+{
+  uint32_t addr = vtop (buffer);
+  uint32_t left = BLOCK_SECTOR_SIZE;
+
+  while (left > 0)
+    {
+      uint32_t chunk = 0x10000 - (addr & 0xffff);
+      if (chunk > left)
+        chunk = left;
+      if (cnt > 0 && prd[cnt - 1].addr + prd[cnt - 1].size == addr
+          && (addr & 0xffff) != 0 && prd[cnt - 1].size + chunk < 0x10000)
+        prd[cnt - 1].size += chunk;
+      else
+        {
+          prd[cnt].addr = addr;
+          prd[cnt].size = chunk;
+          prd[cnt].flags = 0;
+          cnt++;
+        }
+      addr += chunk;
+      left -= chunk;
+    }
+  return cnt;
+}
+
+/* Transfers CNT sectors, at most MAX_CMD_SECTORS, starting at
+   SEC_NO between disk D and BUFFERS by bus master DMA: to the disk
+   if WRITE is true, from it otherwise.  The calling thread sleeps
+   until the disk interrupts at the end of the whole transfer.
+   D's channel lock must be held. */
+static void
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, block_sector_t cnt,
+              void *const buffers[], bool write)
+{
+  struct channel *c = d->channel;
+  uint8_t direction = write ? 0 : BM_CMD_TO_MEMORY;
+  uint8_t bm_status;
+  size_t prd_cnt = 0;
+  block_sector_t i;
+
+  ASSERT (cnt > 0 && cnt <= MAX_CMD_SECTORS);
+
+  /* A page holds 512 descriptors, enough for two per sector. */
+  for (i = 0; i < cnt; i++)
+    prd_cnt = add_prd (c->prd, prd_cnt, buffers[i]);
+  c->prd[prd_cnt - 1].flags = PRD_EOT;
+
+  outb (reg_bm_command (c), 0);
+  outl (reg_bm_prdt (c), vtop (c->prd));
+  outb (reg_bm_status (c), inb (reg_bm_status (c)) | BM_STA_ERR | BM_STA_INTR);
+  outb (reg_bm_command (c), direction);
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+  outb (reg_bm_command (c), direction | BM_CMD_START);
+  sema_down (&c->completion_wait);
+
+  bm_status = inb (reg_bm_status (c));
+  outb (reg_bm_command (c), 0);
+  outb (reg_bm_status (c), bm_status | BM_STA_ERR | BM_STA_INTR);
+  if ((bm_status & BM_STA_ERR) || (inb (reg_status (c)) & STA_ERR))
+    PANIC ("%s: DMA %s failed, sector=%"PRDSNu,
+           d->name, write ? "write" : "read", sec_no);
+}
 
 /* Low-level ATA primitives. */
 
@@ -1,6 +1,10 @@
 #ifndef DEVICES_IDE_H
 #define DEVICES_IDE_H
 
+#include <stdbool.h>
+
 void ide_init (void);
 
+extern bool ide_dma;
+
 #endif /* devices/ide.h */
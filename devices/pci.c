@@ -0,0 +1,171 @@
+#include "devices/pci.h"
+#include <debug.h>
+#include "threads/io.h"
+
+/* This code reads and writes PCI configuration space through
+   configuration mechanism #1, which every PC chipset since the
+   PCI 2.0 days supports, and finds devices by brute force
+   enumeration.  It is just enough for the drivers that need to
+   locate their controller.  See [PCI] for the details. */
+
+/* Configuration mechanism #1 I/O ports. */
+#define PCI_CONFIG_ADDR 0xcf8   /* Selects a configuration register. */
+#define PCI_CONFIG_DATA 0xcfc   /* Reads or writes the selected register. */
+
+/* Header type register, and its multi-function bit. */
+#define PCI_REG_HEADER 0x0c
+#define PCI_HEADER_MULTI 0x00800000
+
+/* Base address register bit that marks an I/O space BAR. */
+#define PCI_BAR_IO 0x1
+
+#define PCI_BUS_CNT 256
+#define PCI_SLOT_CNT 32
+#define PCI_FUNC_CNT 8
+
+/* Selects register REG of DEV for the next access to
+   PCI_CONFIG_DATA. */
+static void
+select_register (const struct pci_dev *dev, uint8_t reg)
+{
+  ASSERT (reg % 4 == 0);
+  outl (PCI_CONFIG_ADDR, (0x80000000u | ((uint32_t) dev->bus << 16)
+                          | ((uint32_t) dev->slot << 11)
+                          | ((uint32_t) dev->func << 8) | reg));
+}
+
+/* Returns the 32-bit configuration register at offset REG, which
+   must be a multiple of 4, of DEV. */
+uint32_t
+pci_read_config (const struct pci_dev *dev, uint8_t reg)
+{
+  select_register (dev, reg);
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Sets the 32-bit configuration register at offset REG, which
+   must be a multiple of 4, of DEV to VALUE. */
+void
+pci_write_config (const struct pci_dev *dev, uint8_t reg, uint32_t value)
+{
+  select_register (dev, reg);
+  outl (PCI_CONFIG_DATA, value);
+}
+
+/* Calls MATCH on every PCI function present, in bus, slot and
+   function order, until it returns true.  Stores the function
+   it returned true for in *DEV and returns true, or returns false
+   if it never did. */
+static bool
+scan (bool (*match) (const struct pci_dev *, void *aux), void *aux,
+      struct pci_dev *dev)
+{
+  int bus, slot, func;
+
+  for (bus = 0; bus < PCI_BUS_CNT; bus++)
+    for (slot = 0; slot < PCI_SLOT_CNT; slot++)
+      for (func = 0; func < PCI_FUNC_CNT; func++)
+        {
+          dev->bus = bus;
+          dev->slot = slot;
+          dev->func = func;
+          if ((pci_read_config (dev, PCI_REG_ID) & 0xffff) == 0xffff)
+            {
+              if (func == 0)
+                break;
+              continue;
+            }
+          if (match (dev, aux))
+            return true;
+          if (func == 0
+              && !(pci_read_config (dev, PCI_REG_HEADER) & PCI_HEADER_MULTI))
+            break;
+        }
+  return false;
+}
+
+/* Class and subclass sought by pci_find_class(). */
+struct class_match
+  {
+    uint8_t class, subclass;
+  };
+
+static bool
+match_class (const struct pci_dev *dev, void *aux)
+{
+  const struct class_match *m = aux;
+  uint32_t class = pci_read_config (dev, PCI_REG_CLASS);
+  return (class >> 24) == m->class && ((class >> 16) & 0xff) == m->subclass;
+}
+
+/* Finds the first PCI function with the given CLASS and SUBCLASS
+   codes and stores its location in *DEV.  Returns true if
+   successful, false if there is none. */
+bool
+pci_find_class (uint8_t class, uint8_t subclass, struct pci_dev *dev)
+{
+  struct class_match m;
+
+  m.class = class;
+  m.subclass = subclass;
+  return scan (match_class, &m, dev);
+}
+
+/* Vendor and device IDs sought by pci_find_device(), and how
+   many matches are still to be skipped. */
+struct id_match
+  {
+    uint32_t id;
+    int skip;
+  };
+
+static bool
+match_id (const struct pci_dev *dev, void *aux)
+{
+  struct id_match *m = aux;
+  return pci_read_config (dev, PCI_REG_ID) == m->id && m->skip-- == 0;
+}
+
+/* Finds the PCI function with the given VENDOR and DEVICE IDs
+   that comes INDEX'th in enumeration order, counting from 0, and
+   stores its location in *DEV.  Returns true if successful, false
+   if there are not that many. */
+bool
+pci_find_device (uint16_t vendor, uint16_t device, int index,
+                 struct pci_dev *dev)
+{
+  struct id_match m;
+
+  m.id = ((uint32_t) device << 16) | vendor;
+  m.skip = index;
+  return scan (match_id, &m, dev);
+}
+
+/* Returns the I/O port base that base address register BAR of DEV
+   decodes, or 0 if BAR is not an I/O space BAR. */
+uint16_t
+pci_io_bar (const struct pci_dev *dev, int bar)
+{
+  uint32_t value;
+
+  ASSERT (bar >= 0 && bar < 6);
+  value = pci_read_config (dev, PCI_REG_BAR0 + bar * 4);
+  return value & PCI_BAR_IO ? value & 0xfffc : 0;
+}
+
+/* Returns the legacy interrupt line the firmware routed DEV's
+   interrupt to. */
+uint8_t
+pci_irq (const struct pci_dev *dev)
+{
+  return pci_read_config (dev, PCI_REG_INTR) & 0xff;
+}
+
+/* Sets COMMAND_BITS, a combination of PCI_CMD_* flags, in DEV's
+   command register, leaving the status register alone. */
+void
+pci_enable (const struct pci_dev *dev, uint16_t command_bits)
+{
+  uint32_t command = pci_read_config (dev, PCI_REG_COMMAND) & 0xffff;
+  pci_write_config (dev, PCI_REG_COMMAND, command | command_bits);
+}
@@ -0,0 +1,39 @@
+#ifndef DEVICES_PCI_H
+#define DEVICES_PCI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Location of a PCI function in configuration space. */
+struct pci_dev
+  {
+    uint8_t bus;                /* Bus number. */
+    uint8_t slot;               /* Device number on the bus. */
+    uint8_t func;               /* Function number in the device. */
+  };
+
+/* Configuration space register offsets. */
+#define PCI_REG_ID 0x00         /* Device ID 31:16, vendor ID 15:0. */
+#define PCI_REG_COMMAND 0x04    /* Status 31:16, command 15:0. */
+#define PCI_REG_CLASS 0x08      /* Class, subclass, prog if, revision. */
+#define PCI_REG_BAR0 0x10       /* First of six base address registers. */
+#define PCI_REG_SUBSYSTEM 0x2c  /* Subsystem ID 31:16, vendor ID 15:0. */
+#define PCI_REG_INTR 0x3c       /* Interrupt line 7:0. */
+
+/* Command register bits. */
+#define PCI_CMD_IO 0x0001       /* Respond to I/O space accesses. */
+#define PCI_CMD_MEMORY 0x0002   /* Respond to memory space accesses. */
+#define PCI_CMD_MASTER 0x0004   /* Allow bus mastering. */
+
+uint32_t pci_read_config (const struct pci_dev *, uint8_t reg);
+void pci_write_config (const struct pci_dev *, uint8_t reg, uint32_t value);
+
+bool pci_find_class (uint8_t class, uint8_t subclass, struct pci_dev *);
+bool pci_find_device (uint16_t vendor, uint16_t device, int index,
+                      struct pci_dev *);
+
+uint16_t pci_io_bar (const struct pci_dev *, int bar);
+uint8_t pci_irq (const struct pci_dev *);
+void pci_enable (const struct pci_dev *, uint16_t command_bits);
+
+#endif /* devices/pci.h */
@@ -0,0 +1,123 @@
+#include "devices/ramdisk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "devices/block.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* A block device kept in kernel memory, for measuring the file
+   system without disk latency and for scratch data that need not
+   survive a reboot.  Its contents start out zeroed and are lost
+   at shutdown.  The memory is taken a page at a time, so it need
+   not be contiguous, and from the user pool while it lasts, since
+   the kernel pool is smaller than most RAM disks worth having.
+   Requests are carried out synchronously, without the queue. */
+
+/* Sectors per page. */
+#define PAGE_SECTORS (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Role and size in sectors requested with -ramdisk=, or a size
+   of 0 if there is to be no RAM disk. */
+static enum block_type ramdisk_type;
+static block_sector_t ramdisk_size;
+
+/* The RAM disk's pages. */
+static uint8_t **pages;
+
+static struct block_operations ramdisk_operations;
+
+/* Requests a RAM disk as SPEC, in the form ROLE:KB, says: KB
+   kilobytes, rounded up to whole pages, to be given ROLE
+   ("filesys", "scratch", ...).  Must be called before
+   ramdisk_init().  Returns false if SPEC is malformed. */
+bool
+ramdisk_configure (const char *spec)
+{
+  const char *colon = strchr (spec, ':');
+  int type;
+  int kb;
+
+  if (colon == NULL)
+    return false;
+  kb = atoi (colon + 1);
+  if (kb <= 0)
+    return false;
+  for (type = 0; type < BLOCK_ROLE_CNT; type++)
+    {
+      const char *name = block_type_name (type);
+      if (strlen (name) == (size_t) (colon - spec)
+          && !memcmp (name, spec, colon - spec))
+        {
+          ramdisk_type = type;
+          ramdisk_size = DIV_ROUND_UP ((size_t) kb * 1024, PGSIZE) * PAGE_SECTORS;
+          return true;
+        }
+    }
+  return false;
+}
+
+/* Allocates and registers the RAM disk "ram0", if one was
+   requested.  Should be called before other block devices are
+   probed, so that it is the first device of its role. */
+void
+ramdisk_init (void)
+{
+  size_t page_cnt = ramdisk_size / PAGE_SECTORS;
+  struct block *block;
+  size_t i;
+
+  if (ramdisk_size == 0)
+    return;
+
+  pages = malloc (page_cnt * sizeof *pages);
+  if (pages == NULL)
+    PANIC ("ram0: out of memory");
+  for (i = 0; i < page_cnt; i++)
+    {
+      pages[i] = palloc_get_page (PAL_USER | PAL_ZERO);
+      if (pages[i] == NULL)
+        pages[i] = palloc_get_page (PAL_ZERO);
+      if (pages[i] == NULL)
+        PANIC ("ram0: out of memory after %zu of %zu pages, "
+               "give Pintos more with -m", i, page_cnt);
+    }
+  block = block_register ("ram0", ramdisk_type, "RAM disk", ramdisk_size,
+                          &ramdisk_operations, NULL);
+  block_set_synchronous (block);
+}
+
+/* Returns the address of SECTOR's data. */
+static uint8_t *
+sector_data (block_sector_t sector)
+{
+  return pages[sector / PAGE_SECTORS]
+         + sector % PAGE_SECTORS * BLOCK_SECTOR_SIZE;
+}
+
+/* Reads SECTOR into BUFFER, which must have room for
+   BLOCK_SECTOR_SIZE bytes. */
+static void
+ramdisk_read (void *aux UNUSED, block_sector_t sector, void *buffer)
+{
+  memcpy (buffer, sector_data (sector), BLOCK_SECTOR_SIZE);
+}
+
+/* Writes SECTOR from BUFFER, which must contain BLOCK_SECTOR_SIZE
+   bytes. */
+static void
+ramdisk_write (void *aux UNUSED, block_sector_t sector, const void *buffer)
+{
+  memcpy (sector_data (sector), buffer, BLOCK_SECTOR_SIZE);
+}
+
+static struct block_operations ramdisk_operations =
+  {
+    ramdisk_read,
+    ramdisk_write,
+    NULL,
+    NULL
+  };
@@ -0,0 +1,9 @@
+#ifndef DEVICES_RAMDISK_H
+#define DEVICES_RAMDISK_H
+
+#include <stdbool.h>
+
+bool ramdisk_configure (const char *spec);
+void ramdisk_init (void);
+
+#endif /* devices/ramdisk.h */
@@ -0,0 +1,448 @@
+#include "devices/virtio-blk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "devices/block.h"
+#include "devices/partition.h"
+#include "devices/pci.h"
+#include "threads/interrupt.h"
+#include "threads/io.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* The code in this file drives the legacy ("transitional") virtio
+   block device that QEMU attaches with -drive if=virtio.  The
+   driver and the device share a ring of descriptors in memory.
+   Each request is a chain of them: a header naming the operation
+   and first sector, one descriptor per sector buffer, and a status
+   byte for the device to fill in.  Many requests may be in the
+   ring at once, so the block layer runs several transfers on a
+   virtio disk concurrently, and the device completes them in any
+   order, posting them to the used ring and raising an interrupt.
+   See sections 2.4 and 5.2 of the virtio 1.0 specification, and
+   its notes on legacy interfaces. */
+
+/* PCI vendor and device ID of a legacy virtio block device. */
+#define VIRTIO_VENDOR 0x1af4
+#define VIRTIO_BLK_DEVICE 0x1001
+
+/* Legacy virtio I/O port addresses, relative to PCI BAR 0. */
+#define reg_features(DISK) ((DISK)->reg_base + 0x00)    /* Host features. */
+#define reg_guest(DISK) ((DISK)->reg_base + 0x04)       /* Guest features. */
+#define reg_queue_pfn(DISK) ((DISK)->reg_base + 0x08)   /* Ring page. */
+#define reg_queue_size(DISK) ((DISK)->reg_base + 0x0c)  /* Ring size. */
+#define reg_queue_sel(DISK) ((DISK)->reg_base + 0x0e)   /* Ring select. */
+#define reg_notify(DISK) ((DISK)->reg_base + 0x10)      /* Ring notify. */
+#define reg_status(DISK) ((DISK)->reg_base + 0x12)      /* Device status. */
+#define reg_isr(DISK) ((DISK)->reg_base + 0x13)         /* ISR status. */
+#define reg_capacity(DISK) ((DISK)->reg_base + 0x14)    /* Size, 64 bits. */
+
+/* Device status bits. */
+#define STA_ACKNOWLEDGE 0x01    /* Guest has noticed the device. */
+#define STA_DRIVER 0x02         /* Guest has a driver for it. */
+#define STA_DRIVER_OK 0x04      /* Driver is ready. */
+#define STA_FAILED 0x80         /* Driver gave up on the device. */
+
+/* A descriptor in the ring. */
+struct vring_desc
+  {
+    uint64_t addr;              /* Physical address of buffer. */
+    uint32_t len;               /* Length of buffer in bytes. */
+    uint16_t flags;             /* VRING_DESC_F_* flags. */
+    uint16_t next;              /* Next descriptor if VRING_DESC_F_NEXT. */
+  };
+
+#define VRING_DESC_F_NEXT 1     /* Chain continues at NEXT. */
+#define VRING_DESC_F_WRITE 2    /* Device writes, rather than reads, it. */
+
+/* Chains the driver offers the device. */
+struct vring_avail
+  {
+    uint16_t flags;
+    uint16_t idx;               /* Where the next entry goes in RING. */
+    uint16_t ring[];            /* Head descriptors of chains. */
+  };
+
+/* Chains the device has finished with. */
+struct vring_used_elem
+  {
+    uint32_t id;                /* Head descriptor of chain. */
+    uint32_t len;               /* Bytes the device wrote. */
+  };
+
+struct vring_used
+  {
+    uint16_t flags;
+    uint16_t idx;               /* Where the next entry goes in RING. */
+    struct vring_used_elem ring[];
+  };
+
+/* Header that starts each request. */
+struct virtio_blk_header
+  {
+    uint32_t type;              /* VIRTIO_BLK_T_*. */
+    uint32_t reserved;
+    uint64_t sector;            /* First sector. */
+  };
+
+#define VIRTIO_BLK_T_IN 0       /* Read. */
+#define VIRTIO_BLK_T_OUT 1      /* Write. */
+#define VIRTIO_BLK_S_OK 0       /* Status of a successful request. */
+
+/* Most sectors in one request, and the descriptors its chain takes
+   with the header and status. */
+#define SEG_MAX 30
+#define CHAIN_LEN (SEG_MAX + 2)
+
+/* Most requests a single transfer puts in the ring at once. */
+#define BATCH_MAX 8
+
+/* A request in the ring. */
+struct virtio_request
+  {
+    struct virtio_blk_header header;    /* Read by device. */
+    uint8_t status;                     /* Written by device. */
+    struct semaphore done;              /* Up'd when device is done. */
+  };
+
+/* A virtio disk. */
+struct virtio_disk
+  {
+    char name[8];               /* Name, e.g. "vda". */
+    uint16_t reg_base;          /* Base I/O port. */
+    uint8_t irq;                /* Interrupt in use. */
+
+    uint16_t size;              /* Number of descriptors in the ring. */
+    struct vring_desc *desc;    /* Descriptor table. */
+    struct vring_avail *avail;  /* Available ring. */
+    volatile struct vring_used *used;   /* Used ring. */
+    uint16_t last_used;         /* USED->idx as of last interrupt. */
+
+    uint16_t free_head;         /* First free descriptor. */
+    struct semaphore slots;     /* Chains that fit in free descriptors. */
+    struct virtio_request **requests;   /* By head descriptor. */
+  };
+
+/* We support up to four virtio disks, like IDE. */
+#define DISK_CNT 4
+static struct virtio_disk disks[DISK_CNT];
+static int disk_cnt;
+
+static struct block_operations virtio_blk_operations;
+
+static bool probe (struct virtio_disk *, const struct pci_dev *);
+static intr_handler_func interrupt_handler;
+
+/* Finds and registers virtio block devices. */
+void
+virtio_blk_init (void)
+{
+  bool irq_used[16] = { false };
+  struct pci_dev pci;
+  int i;
+
+  for (i = 0; disk_cnt < DISK_CNT
+         && pci_find_device (VIRTIO_VENDOR, VIRTIO_BLK_DEVICE, i, &pci); i++)
+    {
+      struct virtio_disk *d = &disks[disk_cnt];
+
+      snprintf (d->name, sizeof d->name, "vd%c", 'a' + disk_cnt);
+      if (!probe (d, &pci))
+        continue;
+      disk_cnt++;
+
+      /* Devices may share an interrupt line, so register the
+         handler only once for each. */
+      if (!irq_used[d->irq - 0x20])
+        {
+          intr_register_ext (d->irq, interrupt_handler, "virtio-blk");
+          irq_used[d->irq - 0x20] = true;
+        }
+    }
+
+  /* Register the disks and read their partition tables, now that
+     their interrupts are handled. */
+  for (i = 0; i < disk_cnt; i++)
+    {
+      struct virtio_disk *d = &disks[i];
+      char extra_info[32];
+      struct block *block;
+      uint32_t capacity = inl (reg_capacity (d));
+
+      snprintf (extra_info, sizeof extra_info, "virtio, %d-entry ring",
+                d->size);
+      block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
+                              &virtio_blk_operations, d);
+      block_set_queue_depth (block, d->size / CHAIN_LEN);
+      partition_scan (block);
+    }
+}
+
+/* Resets the virtio block device at PCI, sets up its ring, and
+   initializes D to drive it.  Returns false, printing a message,
+   if the device cannot be used. */
+static bool
+probe (struct virtio_disk *d, const struct pci_dev *pci)
+{
+  size_t avail_end, used_ofs, page_cnt;
+  uint8_t *ring, line;
+  uint16_t i;
+
+  d->reg_base = pci_io_bar (pci, 0);
+  line = pci_irq (pci);
+  if (d->reg_base == 0 || line == 0 || line >= 16)
+    {
+      printf ("%s: no I/O ports or interrupt, ignoring\n", d->name);
+      return false;
+    }
+  d->irq = line + 0x20;
+  pci_enable (pci, PCI_CMD_IO | PCI_CMD_MASTER);
+
+  /* Reset the device and tell it we can drive it, without asking
+     for any optional features. */
+  outb (reg_status (d), 0);
+  outb (reg_status (d), STA_ACKNOWLEDGE);
+  outb (reg_status (d), STA_ACKNOWLEDGE | STA_DRIVER);
+  outl (reg_guest (d), 0);
+  if (inl (reg_capacity (d) + 4) != 0)
+    {
+      printf ("%s: disk over 2 TB, ignoring\n", d->name);
+      outb (reg_status (d), STA_FAILED);
+      return false;
+    }
+
+  /* The device picks the ring size.  The descriptor table and
+     available ring are followed, at the next page boundary, by the
+     used ring, in physically contiguous memory. */
+  outw (reg_queue_sel (d), 0);
+  d->size = inw (reg_queue_size (d));
+  if (d->size < CHAIN_LEN)
+    {
+      printf ("%s: ring of %d entries is too small, ignoring\n",
+              d->name, d->size);
+      outb (reg_status (d), STA_FAILED);
+      return false;
+    }
+  avail_end = (d->size * sizeof (struct vring_desc)
+               + sizeof (struct vring_avail) + (d->size + 1) * sizeof (uint16_t));
+  used_ofs = ROUND_UP (avail_end, PGSIZE);
+  page_cnt = DIV_ROUND_UP (used_ofs + sizeof (struct vring_used)
+                           + d->size * sizeof (struct vring_used_elem)
+                           + sizeof (uint16_t), PGSIZE);
+  ring = palloc_get_multiple (PAL_ZERO, page_cnt);
+  d->requests = malloc (d->size * sizeof *d->requests);
+  if (ring == NULL || d->requests == NULL)
+    {
+      printf ("%s: out of memory for ring, ignoring\n", d->name);
+      outb (reg_status (d), STA_FAILED);
+      palloc_free_multiple (ring, page_cnt);
+      free (d->requests);
+      return false;
+    }
+  d->desc = (struct vring_desc *) ring;
+  d->avail = (struct vring_avail *) (ring + d->size * sizeof *d->desc);
+  d->used = (struct vring_used *) (ring + used_ofs);
+  d->last_used = 0;
+
+  /* Chain all the descriptors into the free list. */
+  for (i = 0; i < d->size; i++)
+    d->desc[i].next = i + 1;
+  d->free_head = 0;
+  sema_init (&d->slots, d->size / CHAIN_LEN);
+
+  outl (reg_queue_pfn (d), vtop (ring) >> PGBITS);
+  outb (reg_status (d), STA_ACKNOWLEDGE | STA_DRIVER | STA_DRIVER_OK);
+  return true;
+}
+
+/* Request submission. */
+
+/* Takes the first free descriptor in D and points it at the LEN
+   bytes at BUF, with the given FLAGS.  Returns its index.
+   Interrupts must be off. */
+static uint16_t
+take_desc (struct virtio_disk *d, const void *buf, uint32_t len,
+           uint16_t flags)
+{
+  uint16_t i = d->free_head;
+  struct vring_desc *desc = &d->desc[i];
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (i < d->size);
+  d->free_head = desc->next;
+  desc->addr = vtop (buf);
+  desc->len = len;
+  desc->flags = flags;
+  return i;
+}
+
+/* Returns the chain starting at descriptor HEAD to D's free list.
+   Interrupts must be off. */
+static void
+free_chain (struct virtio_disk *d, uint16_t head)
+{
+  uint16_t i = head;
+  bool more;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  do
+    {
+      uint16_t next = d->desc[i].next;
+
+      more = (d->desc[i].flags & VRING_DESC_F_NEXT) != 0;
+      d->desc[i].next = d->free_head;
+      d->free_head = i;
+      i = next;
+    }
+  while (more);
+}
+
+/* Puts REQ, to read CNT sectors starting at SEC_NO into BUFFERS, or
+   to write them from BUFFERS if WRITE is true, into D's ring and
+   notifies the device, waiting first for room in the ring if
+   necessary.  REQ's semaphore is up'd on completion. */
+static void
+submit (struct virtio_disk *d, struct virtio_request *req, bool write,
+        block_sector_t sec_no, block_sector_t cnt, void *const buffers[])
+{
+  uint16_t data_flags = VRING_DESC_F_NEXT | (write ? 0 : VRING_DESC_F_WRITE);
+  enum intr_level old_level;
+  uint16_t head, prev;
+  block_sector_t i;
+
+  ASSERT (cnt > 0 && cnt <= SEG_MAX);
+
+  req->header.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  req->header.reserved = 0;
+  req->header.sector = sec_no;
+  req->status = 0xff;
+  sema_init (&req->done, 0);
+
+  sema_down (&d->slots);
+  old_level = intr_disable ();
+  head = prev = take_desc (d, &req->header, sizeof req->header,
+                           VRING_DESC_F_NEXT);
+  for (i = 0; i < cnt; i++)
+    prev = d->desc[prev].next = take_desc (d, buffers[i], BLOCK_SECTOR_SIZE,
+                                           data_flags);
+  d->desc[prev].next = take_desc (d, &req->status, sizeof req->status,
+                                  VRING_DESC_F_WRITE);
+  d->requests[head] = req;
+
+  /* Publish the chain before the index that makes it visible. */
+  d->avail->ring[d->avail->idx % d->size] = head;
+  barrier ();
+  d->avail->idx++;
+  barrier ();
+  intr_set_level (old_level);
+
+  outw (reg_notify (d), 0);
+}
+
+/* Reads CNT sectors starting at SEC_NO from disk D into BUFFERS,
+   or writes them from BUFFERS if WRITE is true.  Splits the
+   transfer into requests of up to SEG_MAX sectors, and puts up to
+   BATCH_MAX of them into the ring before waiting for any. */
+static void
+transfer (struct virtio_disk *d, bool write, block_sector_t sec_no,
+          block_sector_t cnt, void *const buffers[])
+{
+  while (cnt > 0)
+    {
+      struct virtio_request reqs[BATCH_MAX];
+      block_sector_t sent = 0;
+      int req_cnt, i;
+
+      for (req_cnt = 0; req_cnt < BATCH_MAX && sent < cnt; req_cnt++)
+        {
+          block_sector_t n = cnt - sent < SEG_MAX ? cnt - sent : SEG_MAX;
+          submit (d, &reqs[req_cnt], write, sec_no + sent, n,
+                  buffers + sent);
+          sent += n;
+        }
+      for (i = 0; i < req_cnt; i++)
+        {
+          sema_down (&reqs[i].done);
+          if (reqs[i].status != VIRTIO_BLK_S_OK)
+            PANIC ("%s: disk %s failed, sector=%"PRDSNu, d->name,
+                   write ? "write" : "read",
+                   (block_sector_t) reqs[i].header.sector);
+        }
+      sec_no += sent;
+      cnt -= sent;
+      buffers += sent;
+    }
+}
+
+/* Reads sector SEC_NO from disk D_ into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes. */
+static void
+virtio_blk_read (void *d_, block_sector_t sec_no, void *buffer)
+{
+  transfer (d_, false, sec_no, 1, &buffer);
+}
+
+/* Writes sector SEC_NO to disk D_ from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes.  Returns after the device has completed
+   the write. */
+static void
+virtio_blk_write (void *d_, block_sector_t sec_no, const void *buffer)
+{
+  void *buf = (void *) buffer;
+
+  transfer (d_, true, sec_no, 1, &buf);
+}
+
+/* Reads CNT sectors starting at SEC_NO from disk D_, sector I
+   into BUFFERS[I]. */
+static void
+virtio_blk_read_multiple (void *d_, block_sector_t sec_no,
+                          block_sector_t cnt, void *const buffers[])
+{
+  transfer (d_, false, sec_no, cnt, buffers);
+}
+
+/* Writes CNT sectors starting at SEC_NO to disk D_, sector I
+   from BUFFERS[I]. */
+static void
+virtio_blk_write_multiple (void *d_, block_sector_t sec_no,
+                           block_sector_t cnt, const void *const buffers[])
+{
+  transfer (d_, true, sec_no, cnt, (void *const *) buffers);
+}
+
+static struct block_operations virtio_blk_operations =
+  {
+    virtio_blk_read,
+    virtio_blk_write,
+    virtio_blk_read_multiple,
+    virtio_blk_write_multiple
+  };
+
+/* Virtio interrupt handler.  Acknowledges the interrupt on each
+   disk using the line, and completes the requests the device has
+   moved to its used ring. */
+static void
+interrupt_handler (struct intr_frame *f)
+{
+  struct virtio_disk *d;
+
+  for (d = disks; d < disks + disk_cnt; d++)
+    if (f->vec_no == d->irq)
+      {
+        inb (reg_isr (d));
+        while (d->last_used != d->used->idx)
+          {
+            uint16_t head = d->used->ring[d->last_used % d->size].id;
+            struct virtio_request *req = d->requests[head];
+
+            free_chain (d, head);
+            d->last_used++;
+            sema_up (&req->done);
+            sema_up (&d->slots);
+          }
+      }
+}
@@ -0,0 +1,200 @@
+#include "cache-policy.h"
+#include "lib/kernel/list.h"
+#include "lib/kernel/hash.h"
+
+/* CAR, CLOCK with Adaptive Replacement (Bansal and Modha, 2004).
+
+   Resident blocks live on two clocks: T1 holds blocks referenced
+   once since they were loaded, T2 blocks referenced again. Ghost
+   lists B1 and B2 remember the sectors recently evicted from T1
+   and T2. A miss on a B1 ghost means T1 was too small and grows
+   the target size of T1; a miss on a B2 ghost shrinks it. A
+   sequential scan only cycles through T1, so the inode, indirect
+   and directory blocks that live on T2 survive it.
+
+   As in CLOCK, a hit only sets the block's accessed bit. */
+
+/* Lists a resident block can be on */
+#define CAR_T1 1
+#define CAR_T2 2
+
+/* A sector recently evicted from T1 or T2 */
+struct ghost {
+	block_sector_t sector;			/* Evicted sector */
+	bool in_b2;						/* On B2 rather than B1 */
+	struct list_elem elem;			/* List_elem in b1 or b2 */
+	struct hash_elem hash_elem;		/* Hash_elem in ghosts */
+};
+
+static struct list t1, t2;			/* Resident clocks, hand at front */
+static struct list b1, b2;			/* Ghost lists, most recent at front */
+static size_t t1_cnt, t2_cnt, b1_cnt, b2_cnt;
+static struct hash ghosts;			/* Ghosts on b1 or b2 by sector */
+static size_t capacity;				/* Number of cache blocks, c */
+static size_t target;				/* Target size of T1, p */
+
+static unsigned ghost_hash (const struct hash_elem *e, void *aux UNUSED) {
+	return hash_int ((int) hash_entry (e, struct ghost, hash_elem)->sector);
+}
+
+static bool ghost_less (const struct hash_elem *a, const struct hash_elem *b,
+                        void *aux UNUSED) {
+	return hash_entry (a, struct ghost, hash_elem)->sector
+	       < hash_entry (b, struct ghost, hash_elem)->sector;
+}
+
+static void car_init (size_t capacity_) {
+	list_init (&t1);
+	list_init (&t2);
+	list_init (&b1);
+	list_init (&b2);
+	t1_cnt = t2_cnt = b1_cnt = b2_cnt = 0;
+	if (!hash_init (&ghosts, ghost_hash, ghost_less, NULL))
+		PANIC ("buffer cache ghost table creation failed");
+	capacity = capacity_;
+	target = 0;
+}
+
+/* Return the ghost of sector id, or NULL */
+static struct ghost *ghost_find (block_sector_t id) {
+	struct ghost key;
+	key.sector = id;
+	struct hash_elem *e = hash_find (&ghosts, &key.hash_elem);
+	return e ? hash_entry (e, struct ghost, hash_elem) : NULL;
+}
+
+/* Forget ghost g */
+static void ghost_drop (struct ghost *g) {
+	list_remove (&g->elem);
+	hash_delete (&ghosts, &g->hash_elem);
+	if (g->in_b2)
+		b2_cnt--;
+	else
+		b1_cnt--;
+	free (g);
+}
+
+/* Forget the least recently evicted ghost on list l */
+static void ghost_drop_oldest (struct list *l) {
+	if (!list_empty (l))
+		ghost_drop (list_entry (list_back (l), struct ghost, elem));
+}
+
+/* Remember that sector id was just evicted from T2 if in_b2,
+   otherwise from T1. Losing a ghost to memory pressure only
+   costs adaptivity, so allocation failure is ignored */
+static void ghost_add (block_sector_t id, bool in_b2) {
+	struct ghost *g = malloc (sizeof *g);
+	if (!g)
+		return;
+	g->sector = id;
+	g->in_b2 = in_b2;
+	hash_insert (&ghosts, &g->hash_elem);
+	if (in_b2) {
+		list_push_front (&b2, &g->elem);
+		b2_cnt++;
+	} else {
+		list_push_front (&b1, &g->elem);
+		b1_cnt++;
+	}
+}
+
+static void car_install (cache_block *blk, block_sector_t id) {
+	struct ghost *g = ghost_find (id);
+	if (!g) {
+		/* Keep |T1| + |B1| <= c and the whole directory <= 2c */
+		if (t1_cnt + b1_cnt >= capacity)
+			ghost_drop_oldest (&b1);
+		else if (t1_cnt + t2_cnt + b1_cnt + b2_cnt >= 2 * capacity)
+			ghost_drop_oldest (&b2);
+		list_push_back (&t1, &blk->elem);
+		blk->policy_list = CAR_T1;
+		t1_cnt++;
+	} else {
+		size_t delta;
+		if (!g->in_b2) {
+			delta = b1_cnt >= b2_cnt ? 1 : b2_cnt / b1_cnt;
+			target = target + delta < capacity ? target + delta : capacity;
+		} else {
+			delta = b2_cnt >= b1_cnt ? 1 : b1_cnt / b2_cnt;
+			target = target > delta ? target - delta : 0;
+		}
+		ghost_drop (g);
+		list_push_back (&t2, &blk->elem);
+		blk->policy_list = CAR_T2;
+		t2_cnt++;
+	}
+	blk->accessed = false;
+}
+
+/* Unlink a victim, from T1 or T2 as CAR chooses. Once a whole lap
+   of the chosen list was stepped over because its blocks are in use,
+   the other list is tried. Returns NULL if neither has a victim */
+static cache_block *car_evict (void) {
+	size_t t1_skip = 0, t2_skip = 0;
+	for (;;) {
+		bool from_t1 = t2_cnt == 0 || (t1_cnt > 0 && t1_cnt >= (target > 1 ? target : 1));
+		if (from_t1 ? t1_skip >= t1_cnt : t2_skip >= t2_cnt)
+			from_t1 = !from_t1;
+		if (from_t1 ? t1_skip >= t1_cnt : t2_skip >= t2_cnt)
+			return NULL;
+		struct list *l = from_t1 ? &t1 : &t2;
+		cache_block *blk = list_entry (list_pop_front (l), cache_block, elem);
+		if (!buffer_evictable (blk)) {
+			list_push_back (l, &blk->elem);
+			if (from_t1)
+				t1_skip++;
+			else
+				t2_skip++;
+			continue;
+		}
+		if (blk->accessed) {
+			/* Referenced again: T1 promotes to T2, T2 gets another lap */
+			blk->accessed = false;
+			list_push_back (&t2, &blk->elem);
+			if (from_t1) {
+				blk->policy_list = CAR_T2;
+				t1_cnt--;
+				t2_cnt++;
+			}
+			continue;
+		}
+		if (from_t1)
+			t1_cnt--;
+		else
+			t2_cnt--;
+		blk->policy_list = 0;
+		if (blk->sector_index != (block_sector_t) -1)
+			ghost_add (blk->sector_index, !from_t1);
+		return blk;
+	}
+}
+
+/* Unlink blk, remembering which list it was on for car_restore */
+static void car_remove (cache_block *blk) {
+	list_remove (&blk->elem);
+	if (blk->policy_list == CAR_T1)
+		t1_cnt--;
+	else
+		t2_cnt--;
+}
+
+/* Put blk back at the end of the list car_remove took it from */
+static void car_restore (cache_block *blk) {
+	if (blk->policy_list == CAR_T2) {
+		list_push_back (&t2, &blk->elem);
+		t2_cnt++;
+	} else {
+		list_push_back (&t1, &blk->elem);
+		t1_cnt++;
+	}
+}
+
+const struct cache_policy cache_car_policy = {
+	"car",
+	car_init,
+	car_install,
+	car_evict,
+	car_remove,
+	car_restore
+};
@@ -0,0 +1,64 @@
+#include "cache-policy.h"
+#include "lib/kernel/list.h"
+
+/* Plain CLOCK: one ring of resident blocks swept by a hand that
+   clears reference bits and takes the first unreferenced block.
+   Approximates LRU, so a long sequential scan flushes the cache. */
+
+/* Ring of all resident cache_block, and the clock hand */
+static struct list clock_list;
+static struct list_elem *clock_hand;
+
+static void clock_init (size_t capacity UNUSED) {
+	list_init (&clock_list);
+	clock_hand = list_end (&clock_list);
+}
+
+/* Insert blk just behind the hand, the last position it will reach */
+static void clock_install (cache_block *blk, block_sector_t id UNUSED) {
+	list_insert (clock_hand, &blk->elem);
+	blk->accessed = false;
+}
+
+/* Sweep the hand past referenced blocks and unlink the first
+   unreferenced block that is not in use. Gives up and returns NULL
+   after two turns, which clear every reference bit, if all blocks
+   are in use */
+static cache_block *clock_evict (void) {
+	size_t steps = 2 * list_size (&clock_list);
+	while (steps-- > 0) {
+		if (clock_hand == list_end (&clock_list))
+			clock_hand = list_begin (&clock_list);
+		cache_block *blk = list_entry (clock_hand, cache_block, elem);
+		clock_hand = list_next (clock_hand);
+		if (!buffer_evictable (blk))
+			continue;
+		if (blk->accessed) {
+			blk->accessed = false;
+			continue;
+		}
+		list_remove (&blk->elem);
+		return blk;
+	}
+	return NULL;
+}
+
+static void clock_remove (cache_block *blk) {
+	if (clock_hand == &blk->elem)
+		clock_hand = list_next (clock_hand);
+	list_remove (&blk->elem);
+}
+
+/* Put blk back just behind the hand, keeping its reference bit */
+static void clock_restore (cache_block *blk) {
+	list_insert (clock_hand, &blk->elem);
+}
+
+const struct cache_policy cache_clock_policy = {
+	"clock",
+	clock_init,
+	clock_install,
+	clock_evict,
+	clock_remove,
+	clock_restore
+};
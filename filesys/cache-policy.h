@@ -0,0 +1,30 @@
+#ifndef CACHE_POLICY_H
+#define CACHE_POLICY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "cache.h"
+
+/* A buffer cache replacement policy.
+   All hooks are called with the cache's replacement lock held,
+   so a policy needs no locking of its own. A cache hit never
+   calls into the policy; it only sets the block's accessed bit. */
+struct cache_policy {
+  const char *name;                         /* Name for -cache= option */
+  void (*init) (size_t capacity);           /* Set up for CAPACITY blocks */
+  void (*install) (cache_block *, block_sector_t id);
+                                            /* Victim is about to hold id,
+                                               or -1 for anon data */
+  cache_block *(*evict) (void);             /* Pick and unlink a victim,
+                                               NULL if all are in use */
+  void (*remove) (cache_block *);           /* Block no longer holds a sector,
+                                               or is pinned */
+  void (*restore) (cache_block *);          /* Removed block is unpinned */
+};
+
+extern const struct cache_policy cache_clock_policy;
+extern const struct cache_policy cache_car_policy;
+
+bool buffer_evictable (const cache_block *);
+
+#endif
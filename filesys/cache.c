@@ -1,23 +1,144 @@
 #include "cache.h"
+#include <debug.h>
+#include <stddef.h>
+#include "cache-policy.h"
 #include "lib/kernel/list.h"
+#include "lib/kernel/hash.h"
+#include "lib/stdlib.h"
+#include "threads/thread.h"
+#include "devices/timer.h"
+
+/* Sector number of a cache_block that holds no sector */
+#define SECTOR_NONE ((block_sector_t) -1)
+
+/* Converts a pointer to a cache_block's data, as handed out by the
+   pin functions, back into the cache_block */
+#define data_to_block(DATA) \
+	((cache_block *) ((uint8_t *) (DATA) - offsetof (cache_block, data)))
+
+/* Number of hash buckets indexing cache_blocks by sector, a power of 2 */
+#define CACHE_BUCKET_CNT 128
 
 /* Overall number of cache_blocks created */
-static int cache_block_count;    
+static int cache_block_count;
 
 /* Max number of cache_blocks */
-const int MAX_CACHE_BLOCKS = 64;     
+const int MAX_CACHE_BLOCKS = 64;
+
+/* Ticks between periodic write-behind passes */
+#define FLUSH_INTERVAL TIMER_FREQ
+
+/* Percentage of dirty cache_blocks that triggers write-behind early */
+#define DIRTY_RATIO 25
+
+/* Max number of dirty blocks written back per batch */
+#define FLUSH_BATCH 64
+
+/* Max number of pending read-ahead requests */
+#define PREFETCH_QUEUE 16
+
+/* A chain of cache_blocks whose sectors hash to the same bucket.
+   Each bucket has its own lock, so hits on different sectors
+   never serialize on a global lock. */
+struct cache_bucket {
+	struct list blocks;				/* cache_block chain via hash_elem */
+	struct lock lock;				/* Protects blocks */
+};
+
+/* Sector-keyed index of all valid cache_blocks */
+static struct cache_bucket buckets[CACHE_BUCKET_CNT];
+
+/* Replacement policies selectable with -cache=, default first */
+static const struct cache_policy *const policies[] = {
+	&cache_car_policy,
+	&cache_clock_policy,
+	NULL
+};
+
+/* Replacement policy in use */
+static const struct cache_policy *policy = &cache_car_policy;
+
+/* All cache_block ever created, and those holding no sector */
+static struct list all_list;
+static struct list free_list;
+
+/* Lock enforcing consistency of the policy, all_list, free_list
+   and cache_block_count. Only taken to create or evict a block,
+   or to pin and unpin one, never on a hit. */
+static struct lock evict_lock;
+
+/* Signalled under evict_lock when a block may have become evictable,
+   and the number of threads in buffer_find_evict waiting for one */
+static struct condition evict_cond;
+static int evict_waiters;
 
-/* LRU list containing all cache_block */
-static struct list LRU;         
+/* Number of dirty cache_blocks, and lock protecting it and each
+   block's dirty bit transitions */
+static int dirty_count;
+static struct lock dirty_lock;
 
-/* Lock enforcing consistency of LRU list */
-struct lock LRU_lock; 
+/* Wakes the flusher: upped every FLUSH_INTERVAL ticks by the flush
+   timer, and once when dirty_count crosses DIRTY_RATIO, which sets
+   flush_requested until the flusher runs */
+static struct semaphore flush_sema;
+static bool flush_requested;
 
-/* Initializes buffer cache LRU list */
+static void buffer_flusher (void *aux);
+static void buffer_flush_timer (void *aux);
+
+/* A run of contiguous sectors to load into the cache */
+struct prefetch_req {
+	struct block *dev;				/* Device holding the run */
+	block_sector_t sector;			/* First sector */
+	block_sector_t cnt;				/* Number of sectors */
+};
+
+/* Ring of pending read-ahead requests for the prefetch thread,
+   protected by prefetch_lock */
+static struct prefetch_req prefetch_queue[PREFETCH_QUEUE];
+static size_t prefetch_head, prefetch_cnt;
+static struct lock prefetch_lock;
+static struct condition prefetch_cond;
+
+static void buffer_prefetcher (void *aux);
+
+/* Selects the replacement policy called name. Must be called
+   before buffer_init. Returns false if there is no such policy */
+bool buffer_select_policy (const char *name) {
+	const struct cache_policy *const *p;
+	for (p = policies; *p != NULL; p++) {
+		if (!strcmp ((*p)->name, name)) {
+			policy = *p;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Initializes buffer cache replacement policy and hash index */
 void buffer_init (void) {
+	int i;
 	cache_block_count = 0;
-	list_init (&LRU);
-	lock_init (&LRU_lock);
+	list_init (&all_list);
+	list_init (&free_list);
+	lock_init (&evict_lock);
+	cond_init (&evict_cond);
+	evict_waiters = 0;
+	for (i = 0; i < CACHE_BUCKET_CNT; i++) {
+		list_init (&buckets[i].blocks);
+		lock_init (&buckets[i].lock);
+	}
+	policy->init (MAX_CACHE_BLOCKS);
+	dirty_count = 0;
+	lock_init (&dirty_lock);
+	flush_requested = false;
+	sema_init (&flush_sema, 0);
+	thread_create ("flusher", PRI_DEFAULT, buffer_flusher, NULL);
+	thread_create ("flush-timer", PRI_DEFAULT, buffer_flush_timer, NULL);
+	prefetch_head = prefetch_cnt = 0;
+	lock_init (&prefetch_lock);
+	cond_init (&prefetch_cond);
+	thread_create ("prefetch", PRI_DEFAULT, buffer_prefetcher, NULL);
 }
 
 /* Check if sector_index requested is valid */
@@ -30,256 +151,723 @@ static inline void buffer_flush (struct block *fs_device, cache_block *blk, bloc
 	block_write (fs_device, id, blk->data);
 }
 
-/* Decide a cache entry to evict in LRU list */
-static cache_block *buffer_find_evict (void) {
+/* Mark blk dirty after its data was modified */
+static void buffer_set_dirty (cache_block *blk) {
+	blk->dirty_tick = timer_ticks ();
+	if (blk->dirty)
+		return;
+	lock_acquire (&dirty_lock);
+	if (!blk->dirty) {
+		blk->dirty = true;
+		dirty_count++;
+		if (!flush_requested && dirty_count * 100 >= MAX_CACHE_BLOCKS * DIRTY_RATIO) {
+			flush_requested = true;
+			sema_up (&flush_sema);
+		}
+	}
+	lock_release (&dirty_lock);
+}
+
+/* Mark blk clean, before its data is written back, so that a
+   concurrent modification marks it dirty again */
+static void buffer_set_clean (cache_block *blk) {
+	lock_acquire (&dirty_lock);
+	if (blk->dirty) {
+		blk->dirty = false;
+		dirty_count--;
+	}
+	lock_release (&dirty_lock);
+}
+
+/* Return the hash bucket sector id belongs to */
+static inline struct cache_bucket *buffer_bucket (block_sector_t id) {
+	return &buckets[hash_int ((int) id) & (CACHE_BUCKET_CNT - 1)];
+}
+
+/* Find the cache_block holding id in bucket b, whose lock
+   must be held. Returns NULL if id is not cached */
+static cache_block *buffer_lookup (struct cache_bucket *b, block_sector_t id) {
 	struct list_elem *el;
-	cache_block *blk = NULL;
-	lock_acquire (&LRU_lock);
-	for (el = list_back (&LRU); el != list_head (&LRU); el = list_prev (el)) {
-		blk = list_entry (el, cache_block, elem);
-		if (!(blk->exclude_active + blk->exclude_wait))
-			goto found;
+	for (el = list_begin (&b->blocks); el != list_end (&b->blocks); el = list_next (el)) {
+		cache_block *blk = list_entry (el, cache_block, hash_elem);
+		if (blk->sector_index == id)
+			return blk;
 	}
-	blk = list_entry (list_back (&LRU), cache_block, elem);
-found:
+	return NULL;
+}
+
+/* Enter blk as a shared accessor, waiting out any pending
+   or active exclusive access. A pinned block is joined even if
+   exclusive access is pending: the pending evictor waits for the
+   pin anyway, and the pin holder may itself be re-entering */
+static void buffer_acquire_shared (cache_block *blk) {
 	lock_acquire (&blk->lock_cache);
-	blk->exclude_wait++;
+	while (blk->exclude_active || (blk->exclude_wait && !blk->pin_cnt)) {
+		blk->share_wait++;
+		cond_wait (&blk->share_cond, &blk->lock_cache);
+		blk->share_wait--;
+	}
+	blk->share_active++;
 	lock_release (&blk->lock_cache);
-	lock_release (&LRU_lock);
-	return blk;
 }
 
-/* Create a new cache_block from buf and replace an old 
-   entry in LRU. Evict if possible */
-static cache_block *buffer_update_old (struct block *fs_device, block_sector_t id, uint8_t *buf) {
-	cache_block *blk = buffer_find_evict ();
+/* Leave blk as a shared accessor */
+static void buffer_release_shared (cache_block *blk) {
+	lock_acquire (&blk->lock_cache);
+	blk->share_active--;
+	if (blk->share_active == 0 && blk->exclude_wait > 0)
+		cond_signal (&blk->exclude_cond, &blk->lock_cache);
+	lock_release (&blk->lock_cache);
+}
+
+/* Turn a pending exclusive request on blk, registered in
+   exclude_wait, into exclusive access */
+static void buffer_claim_exclusive (cache_block *blk) {
 	lock_acquire (&blk->lock_cache);
 	while (blk->share_active + blk->exclude_active) {
 		cond_wait (&blk->exclude_cond, &blk->lock_cache);
 	}
-	block_sector_t old_id = blk->sector_index;
 	blk->exclude_wait--;
 	blk->exclude_active++;
-	blk->sector_index = id;
 	lock_release (&blk->lock_cache);
+}
 
-	if (blk->dirty) {
-		buffer_flush (fs_device, blk, old_id);
-	}
-	if (buf) {
-		memcpy (blk->data, buf, BLOCK_SECTOR_SIZE);
-	}
-	
-	free (buf);	
-	blk->dirty = false;
-	
-	if (cache_block_count > 1) {
-		lock_acquire (&LRU_lock);
-		list_remove (&blk->elem);
-		list_push_front (&LRU, &blk->elem);
-		lock_release (&LRU_lock);
-	}
-
+/* Give up exclusive access to blk */
+static void buffer_release_exclusive (cache_block *blk) {
 	lock_acquire (&blk->lock_cache);
-    blk->exclude_active--;
-	if (blk->exclude_wait){ 
+	blk->exclude_active--;
+	if (blk->exclude_wait) {
 		cond_signal (&blk->exclude_cond, &blk->lock_cache);
 	} else if (blk->share_wait) {
 		cond_broadcast (&blk->share_cond, &blk->lock_cache);
 	}
-	blk->share_wait = blk->share_active = blk->exclude_wait = blk->exclude_active = 0;
 	lock_release (&blk->lock_cache);
-	return blk;
 }
 
-/* Create a new cache_block from buf and insert to LRU */
-static cache_block *buffer_create_block (struct block *fs_device, block_sector_t id, uint8_t *buf) {
-	if (cache_block_count >= MAX_CACHE_BLOCKS) 
-		return buffer_update_old (fs_device, id, 0);
+/* Whether the replacement policy may pick blk as a victim:
+   blk must not be pinned or already claimed by another evictor */
+bool buffer_evictable (const cache_block *blk) {
+	return !(blk->exclude_active + blk->exclude_wait) && !blk->pin_cnt;
+}
+
+/* Create a new empty cache_block. evict_lock must be held */
+static cache_block *buffer_create_block (void) {
 	cache_block *blk = calloc (1, sizeof (cache_block));
-	if (buf) {
-		memcpy (blk->data, buf, BLOCK_SECTOR_SIZE);
-		free (buf);
-	}
-	blk->sector_index = id;
+	if (!blk)
+		return NULL;
+	blk->sector_index = SECTOR_NONE;
 	blk->dirty = false;
+	blk->accessed = false;
 	blk->share_wait = blk->share_active = blk->exclude_wait = blk->exclude_active = 0;
+	blk->pin_cnt = 0;
 	cond_init (&blk->share_cond);
 	cond_init (&blk->exclude_cond);
 	lock_init (&blk->lock_cache);
+	list_push_back (&all_list, &blk->all_elem);
+	cache_block_count++;
+	return blk;
+}
 
-	bool duplicate = false;
-	lock_acquire (&LRU_lock);
-	
-	struct list_elem *el;
-	for (el = list_begin (&LRU); el != list_end (&LRU); el = list_next (el)) {
-		cache_block *block = list_entry (el, cache_block, elem);
-		if (block->sector_index == id) {
-            duplicate = true;
-            break;
-		}
-	}
+/* Take a block to reuse: an empty block if there is one, a new
+   block while the cache is not full, otherwise the replacement
+   policy's victim. Returns NULL if every block is in use.
+   evict_lock must be held */
+static cache_block *buffer_take_victim (void) {
+	cache_block *blk = NULL;
+	if (!list_empty (&free_list)) {
+		blk = list_entry (list_pop_front (&free_list), cache_block, elem);
+		blk->is_free = false;
+	} else if (cache_block_count < MAX_CACHE_BLOCKS)
+		blk = buffer_create_block ();
+	if (!blk)
+		blk = policy->evict ();
+	return blk;
+}
 
-	if (!duplicate) {
-		list_push_front (&LRU, &blk->elem);
+/* Decide a cache entry to hold sector id, see buffer_take_victim.
+   The block is handed to the policy as holding id and returned with
+   an exclusive request pending, so no other evictor picks it */
+static cache_block *buffer_find_evict (block_sector_t id) {
+	cache_block *blk;
+	lock_acquire (&evict_lock);
+	blk = buffer_take_victim ();
+	if (blk == NULL) {
+		/* Every block is pinned or being loaded: wait for one to be
+		   let go. Waiters are counted before looking again, so one
+		   let go meanwhile is either seen or signalled */
+		evict_waiters++;
+		barrier ();
+		while ((blk = buffer_take_victim ()) == NULL)
+			cond_wait (&evict_cond, &evict_lock);
+		evict_waiters--;
 	}
-	
-	lock_release (&LRU_lock);
-	cache_block_count++;
+	policy->install (blk, id);
+	lock_acquire (&blk->lock_cache);
+	blk->exclude_wait++;
+	lock_release (&blk->lock_cache);
+	lock_release (&evict_lock);
 	return blk;
 }
 
-/* Import block from block device */
-static cache_block *buffer_import_block (struct block *fs_device, block_sector_t id) {
+/* Wake threads waiting in buffer_find_evict after a block was
+   loaded and so became evictable. evict_lock must not be held */
+static void buffer_wake_evictors (void) {
+	if (evict_waiters == 0)
+		return;
+	lock_acquire (&evict_lock);
+	cond_broadcast (&evict_cond, &evict_lock);
+	lock_release (&evict_lock);
+}
+
+/* Drop the sector blk, held exclusively, used to hold. It is
+   written back while still indexed under the old sector, so a
+   reader missing on it cannot fetch stale data from disk */
+static void buffer_unindex (cache_block *blk) {
+	block_sector_t old_id = blk->sector_index;
+	if (old_id == SECTOR_NONE)
+		return;
+	if (blk->dirty) {
+		buffer_set_clean (blk);
+		buffer_flush (fs_device, blk, old_id);
+	}
+	struct cache_bucket *old_b = buffer_bucket (old_id);
+	lock_acquire (&old_b->lock);
+	list_remove (&blk->hash_elem);
+	lock_release (&old_b->lock);
+	blk->sector_index = SECTOR_NONE;
+}
+
+/* Load sector id into a reused cache_block, writing back the
+   sector it held before. If src is non-null it supplies the new
+   contents, which are marked dirty, instead of the disk. Sets
+   *filled to whether src was consumed. If another thread loaded
+   id concurrently, returns that thread's block instead */
+static cache_block *buffer_import_block (struct block *fs_device, block_sector_t id,
+                                         const void *src, bool *filled) {
 	if (!buffer_check_sector_index (fs_device, id)) {
 		return NULL;
 	}
-	uint8_t *buf = malloc (BLOCK_SECTOR_SIZE);
-	if (!buf) {
-		return NULL;
+	cache_block *blk = buffer_find_evict (id);
+	buffer_claim_exclusive (blk);
+	buffer_unindex (blk);
+
+	struct cache_bucket *b = buffer_bucket (id);
+	lock_acquire (&b->lock);
+	cache_block *dup = buffer_lookup (b, id);
+	if (dup) {
+		/* Left with the policy as an empty block, which is never
+		   referenced again and so is reused soon */
+		lock_release (&b->lock);
+		blk->accessed = false;
+		buffer_release_exclusive (blk);
+		buffer_wake_evictors ();
+		return dup;
 	}
-	block_read (fs_device, id, (void*) buf);
-	if (cache_block_count < MAX_CACHE_BLOCKS) {
-		return buffer_create_block (fs_device, id, buf);
+	blk->sector_index = id;
+	list_push_front (&b->blocks, &blk->hash_elem);
+	lock_release (&b->lock);
+
+	if (src) {
+		memcpy (blk->data, src, BLOCK_SECTOR_SIZE);
+		buffer_set_dirty (blk);
+		*filled = true;
 	} else {
-		return buffer_update_old (fs_device, id, buf);
+		block_read (fs_device, id, blk->data);
 	}
+	buffer_release_exclusive (blk);
+	buffer_wake_evictors ();
+	return blk;
 }
 
-/* Return cache_block requested, fetch from disk
-   if necessary. Upon accessing, the cache_block
-   is placed to the top of the LRU list */
-static cache_block *buffer_get_block (struct block *fs_device, block_sector_t id) {
-	struct list_elem *el;
-	lock_acquire(&LRU_lock);
-	for (el = list_begin (&LRU); el != list_end (&LRU); el = list_next (el)) {
-		cache_block *block = list_entry (el, cache_block, elem);
-		if (block->sector_index == id) {
-			if (cache_block_count > 1) {
-				list_remove (&block->elem);
-				list_push_front (&LRU, &block->elem);
-			}
-            lock_release (&LRU_lock);
-			return block;
-		}
+/* Return cache_block requested, fetch from disk (or src, see
+   buffer_import_block) if necessary. A hit only takes the lock
+   of the sector's hash bucket and sets the reference bit */
+static cache_block *buffer_get_block (struct block *fs_device, block_sector_t id,
+                                      const void *src, bool *filled) {
+	struct cache_bucket *b = buffer_bucket (id);
+	lock_acquire (&b->lock);
+	cache_block *blk = buffer_lookup (b, id);
+	lock_release (&b->lock);
+	if (blk) {
+		blk->accessed = true;
+		return blk;
 	}
-	lock_release(&LRU_lock);
-	return buffer_import_block (fs_device, id);
+	return buffer_import_block (fs_device, id, src, filled);
 }
 
 /* Helper function to perform read, double checking sector number */
-static bool _read (cache_block *blk, block_sector_t id, void *buf) {
+static bool _read (cache_block *blk, block_sector_t id, size_t ofs, size_t len, void *buf) {
 	bool status = true;
-	lock_acquire (&blk->lock_cache);
-	while (blk->exclude_wait + blk->exclude_active) {
-		blk->share_wait++;
-		cond_wait (&blk->exclude_cond, &blk->lock_cache);
-		blk->share_wait--;
-	}
-	blk->share_active++;
-	lock_release (&blk->lock_cache);
-
+	buffer_acquire_shared (blk);
 	if (blk->sector_index != id)
 		status = false;
-	memcpy (buf, blk->data, BLOCK_SECTOR_SIZE);
-	
-	if (cache_block_count > 1) {
-		lock_acquire (&LRU_lock);
-		list_remove (&blk->elem);
-		list_push_front (&LRU, &blk->elem);
-		lock_release (&LRU_lock);
-	}
-
-	lock_acquire (&blk->lock_cache);
-    blk->share_active--;
-	if (blk->share_active == 0 && blk->exclude_wait > 0)
-		cond_signal (&blk->exclude_cond, &blk->lock_cache);
-	lock_release (&blk->lock_cache);
+	else
+		memcpy (buf, blk->data + ofs, len);
+	buffer_release_shared (blk);
 	return status;
 }
 
-/* Generic interface to read a block */
-bool buffer_read (struct block *fs_device, block_sector_t id, void *buf) {
-	cache_block *blk = buffer_get_block (fs_device, id);
+/* Read len bytes at byte offset ofs within sector id into buf,
+   copying only those bytes out of the cache */
+bool buffer_read_range (struct block *fs_device, block_sector_t id,
+                        size_t ofs, size_t len, void *buf) {
+	ASSERT (ofs + len <= BLOCK_SECTOR_SIZE);
+	bool filled = false;
+	cache_block *blk = buffer_get_block (fs_device, id, NULL, &filled);
 	if (!blk)
 		return false;
-	while (!_read (blk, id, buf)) {
-		blk = buffer_get_block (fs_device, id);
+	while (!_read (blk, id, ofs, len, buf)) {
+		blk = buffer_get_block (fs_device, id, NULL, &filled);
 	}
 	return true;
 }
 
+/* Generic interface to read a block */
+bool buffer_read (struct block *fs_device, block_sector_t id, void *buf) {
+	return buffer_read_range (fs_device, id, 0, BLOCK_SECTOR_SIZE, buf);
+}
+
 /* Helper function to perform write, double checking sector number */
-static bool _write (cache_block* blk, block_sector_t id, void *buf) {
+static bool _write (cache_block* blk, block_sector_t id, size_t ofs, size_t len,
+                    const void *buf) {
 	bool status = true;
+	buffer_acquire_shared (blk);
+	if (blk->sector_index != id) {
+		status = false;
+	} else {
+		memcpy (blk->data + ofs, buf, len);
+		buffer_set_dirty (blk);
+	}
+	buffer_release_shared (blk);
+	return status;
+}
+
+/* Generic interface to write a block. A miss installs buf
+   directly, without reading the old contents from disk */
+bool buffer_write (struct block *fs_device, block_sector_t id, const void *buf) {
+	bool filled = false;
+	cache_block *blk = buffer_get_block (fs_device, id, buf, &filled);
+	if (!blk)
+		return false;
+	while (!filled && !_write (blk, id, 0, BLOCK_SECTOR_SIZE, buf)) {
+		blk = buffer_get_block (fs_device, id, buf, &filled);
+	}
+	return true;
+}
+
+/* Write len bytes from buf at byte offset ofs within sector id,
+   copying only those bytes into the cache. The rest of the
+   sector is read from disk on a miss */
+bool buffer_write_range (struct block *fs_device, block_sector_t id,
+                         size_t ofs, size_t len, const void *buf) {
+	ASSERT (ofs + len <= BLOCK_SECTOR_SIZE);
+	if (len == BLOCK_SECTOR_SIZE)
+		return buffer_write (fs_device, id, buf);
+	bool filled = false;
+	cache_block *blk = buffer_get_block (fs_device, id, NULL, &filled);
+	if (!blk)
+		return false;
+	while (!_write (blk, id, ofs, len, buf)) {
+		blk = buffer_get_block (fs_device, id, NULL, &filled);
+	}
+	return true;
+}
+
+/* Take blk, pinned or about to be, off the policy lists while it
+   is pinned, so evictors do not step over it. evict_lock must be
+   held */
+static void buffer_hold (cache_block *blk) {
+	if (!blk->held) {
+		policy->remove (blk);
+		blk->held = true;
+	}
+}
+
+/* Add a pin to blk, held in shared access, if it still holds id.
+   The first pin takes blk off the policy lists */
+static bool buffer_add_pin (cache_block *blk, block_sector_t id) {
+	bool pinned;
 	lock_acquire (&blk->lock_cache);
-	while (blk->exclude_wait + blk->exclude_active) {
-		blk->share_wait++;
-		cond_wait (&blk->exclude_cond, &blk->lock_cache);
-		blk->share_wait--;
+	pinned = blk->sector_index == id && blk->pin_cnt > 0;
+	if (pinned)
+		blk->pin_cnt++;
+	lock_release (&blk->lock_cache);
+	if (pinned)
+		return true;
+
+	lock_acquire (&evict_lock);
+	lock_acquire (&blk->lock_cache);
+	pinned = blk->sector_index == id;
+	if (pinned && blk->pin_cnt++ == 0)
+		buffer_hold (blk);
+	lock_release (&blk->lock_cache);
+	lock_release (&evict_lock);
+	return pinned;
+}
+
+/* Drop a pin from blk. The last one puts it back with the policy */
+static void buffer_drop_pin (cache_block *blk) {
+	bool last;
+	lock_acquire (&blk->lock_cache);
+	last = blk->pin_cnt == 1;
+	if (!last)
+		blk->pin_cnt--;
+	lock_release (&blk->lock_cache);
+	if (!last)
+		return;
+
+	lock_acquire (&evict_lock);
+	lock_acquire (&blk->lock_cache);
+	if (--blk->pin_cnt == 0 && blk->held) {
+		policy->restore (blk);
+		blk->held = false;
+		cond_broadcast (&evict_cond, &evict_lock);
 	}
-	blk->share_active++;
 	lock_release (&blk->lock_cache);
+	lock_release (&evict_lock);
+}
 
-	if (blk->sector_index != id)
-		status = false;
-	memcpy (blk->data, buf, BLOCK_SECTOR_SIZE);
-	blk->dirty = true;
-
-	if (cache_block_count > 1) {
-		lock_acquire (&LRU_lock);
-		list_remove (&blk->elem);
-		list_push_front (&LRU, &blk->elem);
-		lock_release (&LRU_lock);
+/* Pin sector id in the cache: the block holding it stays in shared
+   access and cannot be evicted until buffer_unpin. Returns NULL
+   if id is not a valid sector */
+static cache_block *buffer_pin_block (struct block *fs_device, block_sector_t id) {
+	bool filled = false;
+	cache_block *blk = buffer_get_block (fs_device, id, NULL, &filled);
+	while (blk) {
+		buffer_acquire_shared (blk);
+		if (buffer_add_pin (blk, id))
+			return blk;
+		buffer_release_shared (blk);
+		blk = buffer_get_block (fs_device, id, NULL, &filled);
 	}
+	return NULL;
+}
 
+/* Return a read-only pointer to the cached contents of sector id,
+   without copying. Must be released with buffer_unpin */
+const void *buffer_pin (struct block *fs_device, block_sector_t id) {
+	cache_block *blk = buffer_pin_block (fs_device, id);
+	return blk ? blk->data : NULL;
+}
+
+/* Return a writable pointer to the cached contents of sector id,
+   without copying. Must be released with buffer_unpin, passing
+   dirty as true if the contents were modified */
+void *buffer_pin_write (struct block *fs_device, block_sector_t id) {
+	cache_block *blk = buffer_pin_block (fs_device, id);
+	return blk ? blk->data : NULL;
+}
+
+/* Release a pin taken by buffer_pin or buffer_pin_write, given the
+   pointer it returned */
+void buffer_unpin (const void *data, bool dirty) {
+	cache_block *blk = data_to_block (data);
+	if (dirty)
+		buffer_set_dirty (blk);
+	buffer_drop_pin (blk);
+	buffer_release_shared (blk);
+}
+
+/* Take a cache_block holding no sector, zeroed and pinned, for data
+   that has no place on disk yet. It is held off the policy lists
+   until given a sector with buffer_unpin_anon, or released with
+   buffer_drop_anon */
+void *buffer_pin_anon (void) {
+	cache_block *blk = buffer_find_evict (SECTOR_NONE);
+	lock_acquire (&evict_lock);
+	buffer_hold (blk);
+	lock_release (&evict_lock);
+	buffer_claim_exclusive (blk);
+	buffer_unindex (blk);
+	memset (blk->data, 0, BLOCK_SECTOR_SIZE);
+
+	/* Trade exclusive access for a pin, without letting an evictor
+	   in between */
 	lock_acquire (&blk->lock_cache);
-    blk->share_active--;
-	if (blk->share_active == 0 && blk->exclude_wait > 0)
-		cond_signal (&blk->exclude_cond, &blk->lock_cache);
+	blk->exclude_active--;
+	blk->share_active++;
+	blk->pin_cnt++;
+	if (blk->share_wait && !blk->exclude_wait)
+		cond_broadcast (&blk->share_cond, &blk->lock_cache);
 	lock_release (&blk->lock_cache);
-	return status;
+	return blk->data;
 }
 
-/* Generic interface to read a block */
-bool buffer_write (struct block *fs_device, block_sector_t id, void *buf) {
-	cache_block *blk = buffer_get_block (fs_device, id);
-	if (!blk)
-		return false;
-	while (!_write (blk, id, buf)) {
-		blk = buffer_get_block (fs_device, id);
+/* Release a block taken by buffer_pin_anon, discarding its data */
+void buffer_drop_anon (void *data) {
+	cache_block *blk = data_to_block (data);
+	lock_acquire (&evict_lock);
+	list_push_back (&free_list, &blk->elem);
+	blk->is_free = true;
+	blk->held = false;
+	cond_broadcast (&evict_cond, &evict_lock);
+	lock_release (&evict_lock);
+	buffer_unpin (data, false);
+}
+
+/* Release a block taken by buffer_pin_anon as the dirty contents
+   of sector id, which must just have been allocated. If a stale
+   copy of id is still cached, the data is copied into it instead */
+void buffer_unpin_anon (void *data, struct block *fs_device, block_sector_t id) {
+	cache_block *blk = data_to_block (data);
+	struct cache_bucket *b = buffer_bucket (id);
+	lock_acquire (&b->lock);
+	if (buffer_lookup (b, id)) {
+		lock_release (&b->lock);
+		buffer_write (fs_device, id, data);
+		buffer_drop_anon (data);
+		return;
+	}
+
+	/* blk was installed with the policy when buffer_pin_anon took
+	   it, and joins the lists once the last pin is gone */
+	blk->sector_index = id;
+	list_push_front (&b->blocks, &blk->hash_elem);
+	lock_release (&b->lock);
+	buffer_unpin (data, true);
+}
+
+/* Queue cnt sectors starting at id for asynchronous loading into
+   the cache. Read-ahead is only a hint: the request is dropped if
+   the queue is full */
+void buffer_prefetch (struct block *fs_device, block_sector_t id, block_sector_t cnt) {
+	lock_acquire (&prefetch_lock);
+	if (prefetch_cnt < PREFETCH_QUEUE) {
+		struct prefetch_req *r = &prefetch_queue[(prefetch_head + prefetch_cnt) % PREFETCH_QUEUE];
+		r->dev = fs_device;
+		r->sector = id;
+		r->cnt = cnt;
+		prefetch_cnt++;
+		cond_signal (&prefetch_cond, &prefetch_lock);
+	}
+	lock_release (&prefetch_lock);
+}
+
+/* A read-ahead device request and the block it fills */
+struct prefetch_io {
+	struct block_request req;
+	cache_block *blk;				/* Block, held exclusively */
+	void *buf;						/* Its data */
+};
+
+/* Completion of a read-ahead request: lets readers at the block */
+static void buffer_read_ahead_done (struct block_request *req) {
+	struct prefetch_io *io = req->aux;
+	buffer_release_exclusive (io->blk);
+	buffer_wake_evictors ();
+	free (io);
+}
+
+/* Start reading the sector of blk, held exclusively and already
+   indexed under it. The block is released when the read completes.
+   Requests for consecutive sectors queued meanwhile are merged by
+   the device's dispatch thread into one transfer */
+static void buffer_read_ahead (struct block *fs_device, cache_block *blk) {
+	struct prefetch_io *io = malloc (sizeof *io);
+	if (!io) {
+		block_read (fs_device, blk->sector_index, blk->data);
+		buffer_release_exclusive (blk);
+		buffer_wake_evictors ();
+		return;
+	}
+	io->blk = blk;
+	io->buf = blk->data;
+	block_request_init (&io->req, false, blk->sector_index, 1, &io->buf,
+	                    buffer_read_ahead_done, io);
+	block_submit (fs_device, &io->req);
+}
+
+/* Load the sectors among the cnt starting at id that are not
+   cached already. Each block's read is submitted before the next
+   victim is claimed, so the thread never waits on a victim while
+   holding blocks of its own. Unlike a read, this does not count as
+   a reference to the blocks */
+static void buffer_prefetch_run (struct block *fs_device, block_sector_t id, block_sector_t cnt) {
+	block_sector_t i;
+	for (i = 0; i < cnt; i++) {
+		block_sector_t sector = id + i;
+		struct cache_bucket *b = buffer_bucket (sector);
+		cache_block *blk;
+		if (!buffer_check_sector_index (fs_device, sector))
+			break;
+		lock_acquire (&b->lock);
+		blk = buffer_lookup (b, sector);
+		lock_release (&b->lock);
+		if (blk)
+			continue;
+
+		/* As buffer_import_block, but the read is left to
+		   buffer_read_ahead. Readers of the sector wait for it,
+		   since the block is indexed before it is released */
+		blk = buffer_find_evict (sector);
+		buffer_claim_exclusive (blk);
+		buffer_unindex (blk);
+		lock_acquire (&b->lock);
+		if (buffer_lookup (b, sector)) {
+			lock_release (&b->lock);
+			blk->accessed = false;
+			buffer_release_exclusive (blk);
+			buffer_wake_evictors ();
+			continue;
+		}
+		blk->sector_index = sector;
+		list_push_front (&b->blocks, &blk->hash_elem);
+		lock_release (&b->lock);
+		buffer_read_ahead (fs_device, blk);
+	}
+}
+
+/* Read-ahead thread. Loads each queued run of sectors back to back
+   so the reader finds them cached */
+static void buffer_prefetcher (void *aux UNUSED) {
+	for (;;) {
+		struct prefetch_req r;
+		lock_acquire (&prefetch_lock);
+		while (prefetch_cnt == 0)
+			cond_wait (&prefetch_cond, &prefetch_lock);
+		r = prefetch_queue[prefetch_head];
+		prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE;
+		prefetch_cnt--;
+		lock_release (&prefetch_lock);
+		buffer_prefetch_run (r.dev, r.sector, r.cnt);
 	}
-	return true;
 }
 
 /* Evict all cache entries */
 void buffer_clear (void) {
 	struct list_elem *el;
-	lock_acquire (&LRU_lock);
-	cache_block *blk;
-	for (el = list_begin (&LRU); el != list_end (&LRU); el = list_next (el)) {
-		blk = list_entry (el, cache_block, elem);
+
+	/* Give delayed data its sectors, so that it is no longer pinned,
+	   and bring the free map file up to date */
+	inode_flush_all ();
+	free_map_flush ();
+
+	/* Drop pending read-ahead, so it does not refill the cache */
+	lock_acquire (&prefetch_lock);
+	prefetch_cnt = 0;
+	lock_release (&prefetch_lock);
+
+	/* Blocks are claimed one at a time without holding evict_lock,
+	   since a pin holder may need to evict while the claim waits */
+	lock_acquire (&evict_lock);
+	for (el = list_begin (&all_list); el != list_end (&all_list); el = list_next (el)) {
+		cache_block *blk = list_entry (el, cache_block, all_elem);
 		lock_acquire (&blk->lock_cache);
-		while (blk->exclude_wait + blk->exclude_active) {
-			blk->share_wait++;
-			cond_wait (&blk->exclude_cond, &blk->lock_cache);
-			blk->share_wait--;
-		}
-		blk->share_active++;
+		blk->exclude_wait++;
 		lock_release (&blk->lock_cache);
+		lock_release (&evict_lock);
+		buffer_claim_exclusive (blk);
 
-		if (blk->dirty) {
-			buffer_flush (fs_device, blk, blk->sector_index);
-			blk->dirty = false;
+		block_sector_t id = blk->sector_index;
+		if (id != SECTOR_NONE) {
+			if (blk->dirty) {
+				buffer_set_clean (blk);
+				buffer_flush (fs_device, blk, id);
+			}
+			struct cache_bucket *b = buffer_bucket (id);
+			lock_acquire (&b->lock);
+			list_remove (&blk->hash_elem);
+			lock_release (&b->lock);
 		}
 		memset (blk->data, 0, BLOCK_SECTOR_SIZE);
-		blk->sector_index = -1;
+		blk->sector_index = SECTOR_NONE;
+		blk->accessed = false;
+
+		lock_acquire (&evict_lock);
+		if (!blk->is_free) {
+			policy->remove (blk);
+			list_push_back (&free_list, &blk->elem);
+			blk->is_free = true;
+		}
+		buffer_release_exclusive (blk);
+		cond_broadcast (&evict_cond, &evict_lock);
+	}
+	lock_release (&evict_lock);
+}
+
+/* A dirty block picked for write-back */
+struct flush_entry {
+	block_sector_t sector;			/* Sector the block holds */
+	cache_block *blk;				/* Block, held in shared access */
+};
+
+/* Orders flush entries by ascending sector number */
+static int flush_entry_cmp (const void *a_, const void *b_) {
+	const struct flush_entry *a = a_;
+	const struct flush_entry *b = b_;
+	return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
 
+/* Write back up to FLUSH_BATCH dirty blocks in ascending sector
+   order, so the disk sweeps once instead of seeking back and forth,
+   and each run of consecutive sectors with one device request. All
+   requests are submitted before waiting for any of them. Blocks
+   being evicted are skipped; eviction writes them itself. So are
+   blocks modified within the last FLUSH_INTERVAL, such as the one a
+   file is being appended to, which would only be dirtied again */
+static void buffer_flush_batch (void) {
+	static struct flush_entry batch[FLUSH_BATCH];
+	static void *bufs[FLUSH_BATCH];
+	static struct block_request reqs[FLUSH_BATCH];
+	struct list_elem *el;
+	size_t cnt = 0, req_cnt = 0, i, j;
+
+	/* No block can become exclusive while evict_lock is held, so
+	   a block without pending exclusive access can be entered as
+	   a shared accessor without waiting */
+	lock_acquire (&evict_lock);
+	for (el = list_begin (&all_list); el != list_end (&all_list) && cnt < FLUSH_BATCH;
+	     el = list_next (el)) {
+		cache_block *blk = list_entry (el, cache_block, all_elem);
+		if (!blk->dirty || timer_elapsed (blk->dirty_tick) < FLUSH_INTERVAL)
+			continue;
 		lock_acquire (&blk->lock_cache);
-	    blk->share_active--;
-		if (blk->share_active == 0 && blk->exclude_wait > 0)
-			cond_signal (&blk->exclude_cond, &blk->lock_cache);
+		if (!(blk->exclude_wait + blk->exclude_active) && blk->sector_index != SECTOR_NONE) {
+			blk->share_active++;
+			batch[cnt].sector = blk->sector_index;
+			batch[cnt].blk = blk;
+			cnt++;
+		}
 		lock_release (&blk->lock_cache);
 	}
-	lock_release (&LRU_lock); 
-}
\ No newline at end of file
+	lock_release (&evict_lock);
+
+	qsort (batch, cnt, sizeof *batch, flush_entry_cmp);
+	for (i = 0; i < cnt; i = j) {
+		for (j = i; j < cnt && batch[j].sector == batch[i].sector + (j - i); j++) {
+			buffer_set_clean (batch[j].blk);
+			bufs[j] = batch[j].blk->data;
+		}
+		block_request_init (&reqs[req_cnt], true, batch[i].sector, j - i, bufs + i,
+		                    NULL, NULL);
+		block_submit (fs_device, &reqs[req_cnt++]);
+	}
+	for (i = 0; i < req_cnt; i++)
+		block_wait (&reqs[i]);
+	for (i = 0; i < cnt; i++)
+		buffer_release_shared (batch[i].blk);
+}
+
+/* Wakes the flusher every FLUSH_INTERVAL ticks */
+static void buffer_flush_timer (void *aux UNUSED) {
+	for (;;) {
+		timer_sleep (FLUSH_INTERVAL);
+		sema_up (&flush_sema);
+	}
+}
+
+/* Write-behind thread. Wakes every FLUSH_INTERVAL ticks, or early
+   once DIRTY_RATIO percent of the cache is dirty, and writes changed
+   inodes, free map sectors and one batch of dirty blocks back, so
+   eviction rarely has to write a victim */
+static void buffer_flusher (void *aux UNUSED) {
+	for (;;) {
+		sema_down (&flush_sema);
+		lock_acquire (&dirty_lock);
+		flush_requested = false;
+		lock_release (&dirty_lock);
+		inode_flush_all ();
+		free_map_flush ();
+		buffer_flush_batch ();
+	}
+}
@@ -16,7 +16,15 @@ typedef struct {
   block_sector_t file_start;   		/* Disk inode position on disk. */
   block_sector_t sector_index;  	/* Identify block’s location on disk */
   bool dirty;                  		/* For write-back check */
-  struct list_elem elem;       		/* List_elem in LRU list */
+  int64_t dirty_tick;               /* Timer tick of the last change */
+  bool accessed;                    /* Reference bit for replacement policy */
+  int policy_list;                  /* Replacement policy list holding block */
+  bool is_free;                     /* On free list rather than with policy */
+  bool held;                        /* Taken off the policy while pinned */
+  short pin_cnt;                    /* Number of buffer_pin holders */
+  struct list_elem elem;       		/* List_elem in policy or free list */
+  struct list_elem hash_elem;       /* List_elem in hash bucket chain */
+  struct list_elem all_elem;        /* List_elem in list of all blocks */
   short share_wait;					/* Number of shared accesses */
   short share_active;				/* Number of shared accesse waiters */
   short exclude_wait;				/* Number of exlusive accesses */
@@ -27,10 +35,30 @@ typedef struct {
 } cache_block;
 
 void buffer_init (void);
+bool buffer_select_policy (const char *name);
 
 /* buffer read and wrote */
 bool buffer_read (struct block *fs_device, block_sector_t id, void *buffer);
-bool buffer_write (struct block *fs_device, block_sector_t id, void *buffer);
+bool buffer_write (struct block *fs_device, block_sector_t id, const void *buffer);
+
+/* Read and write part of a sector */
+bool buffer_read_range (struct block *fs_device, block_sector_t id,
+                        size_t ofs, size_t len, void *buffer);
+bool buffer_write_range (struct block *fs_device, block_sector_t id,
+                         size_t ofs, size_t len, const void *buffer);
+
+/* Zero-copy access to a cached sector, held until buffer_unpin */
+const void *buffer_pin (struct block *fs_device, block_sector_t id);
+void *buffer_pin_write (struct block *fs_device, block_sector_t id);
+void buffer_unpin (const void *data, bool dirty);
+
+/* Pinned blocks for data not yet given a sector */
+void *buffer_pin_anon (void);
+void buffer_unpin_anon (void *data, struct block *fs_device, block_sector_t id);
+void buffer_drop_anon (void *data);
+
+/* Asynchronous read-ahead of a run of contiguous sectors */
+void buffer_prefetch (struct block *fs_device, block_sector_t id, block_sector_t cnt);
 
 /* Reset buffer */
 void buffer_clear (void);
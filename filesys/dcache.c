@@ -0,0 +1,170 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/synch.h"
+
+/* The dentry cache remembers what recent lookups of a name in a
+   directory found: the sector of the name's inode, or that the
+   name does not exist.  Entries are keyed by the directory's inode
+   sector and the name, hashed into buckets, and the least recently
+   used one is reused when the cache is full.  Directories keep the
+   cache up to date as names are added and removed, so a hit never
+   has to read the directory. */
+
+/* Number of entries. */
+#define DENTRY_CNT 512
+
+/* Number of hash buckets. */
+#define BUCKET_CNT 128
+
+/* A cached lookup. */
+struct dentry
+  {
+    struct list_elem hash_elem;         /* Element in bucket, if used. */
+    struct list_elem lru_elem;          /* Element in lru_list. */
+    bool in_use;                        /* Holds a lookup? */
+    block_sector_t dir;                 /* Directory's inode sector. */
+    char name[NAME_MAX + 1];            /* Null terminated name. */
+    block_sector_t sector;              /* Inode sector or DCACHE_NEGATIVE. */
+  };
+
+static struct dentry dentries[DENTRY_CNT];
+static struct list buckets[BUCKET_CNT];
+
+/* All entries, most recently used first.  Unused entries are kept
+   at the back, so they are taken before any lookup is dropped. */
+static struct list lru_list;
+
+static struct lock dcache_lock;
+
+/* Returns the bucket for NAME in directory DIR. */
+static struct list *
+bucket_of (block_sector_t dir, const char *name)
+{
+  return &buckets[(hash_string (name) ^ hash_int (dir)) % BUCKET_CNT];
+}
+
+/* Returns the entry for NAME in directory DIR, or a null pointer.
+   dcache_lock must be held. */
+static struct dentry *
+find (block_sector_t dir, const char *name)
+{
+  struct list *bucket = bucket_of (dir, name);
+  struct list_elem *e;
+
+  for (e = list_begin (bucket); e != list_end (bucket); e = list_next (e))
+    {
+      struct dentry *d = list_entry (e, struct dentry, hash_elem);
+      if (d->dir == dir && !strcmp (d->name, name))
+        return d;
+    }
+  return NULL;
+}
+
+/* Drops the lookup D holds and moves it behind the used entries.
+   dcache_lock must be held. */
+static void
+discard (struct dentry *d)
+{
+  list_remove (&d->hash_elem);
+  d->in_use = false;
+  list_remove (&d->lru_elem);
+  list_push_back (&lru_list, &d->lru_elem);
+}
+
+/* Initializes the dentry cache. */
+void
+dcache_init (void)
+{
+  size_t i;
+
+  for (i = 0; i < BUCKET_CNT; i++)
+    list_init (&buckets[i]);
+  list_init (&lru_list);
+  for (i = 0; i < DENTRY_CNT; i++)
+    {
+      dentries[i].in_use = false;
+      list_push_back (&lru_list, &dentries[i].lru_elem);
+    }
+  lock_init (&dcache_lock);
+}
+
+/* Looks up NAME in directory DIR.  If the cache knows the answer,
+   returns true and sets *SECTORP to the sector of NAME's inode, or
+   to DCACHE_NEGATIVE if NAME does not exist.  Otherwise returns
+   false. */
+bool
+dcache_lookup (block_sector_t dir, const char *name, block_sector_t *sectorp)
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+    {
+      *sectorp = d->sector;
+      list_remove (&d->lru_elem);
+      list_push_front (&lru_list, &d->lru_elem);
+    }
+  lock_release (&dcache_lock);
+  return d != NULL;
+}
+
+/* Records that NAME in directory DIR has its inode in SECTOR, or
+   does not exist if SECTOR is DCACHE_NEGATIVE.  Callers hold DIR's
+   dir_lock, so that the record cannot race with a change to DIR. */
+void
+dcache_insert (block_sector_t dir, const char *name, block_sector_t sector)
+{
+  struct dentry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d == NULL)
+    {
+      d = list_entry (list_back (&lru_list), struct dentry, lru_elem);
+      if (d->in_use)
+        list_remove (&d->hash_elem);
+      d->in_use = true;
+      d->dir = dir;
+      strlcpy (d->name, name, sizeof d->name);
+      list_push_front (bucket_of (dir, name), &d->hash_elem);
+    }
+  d->sector = sector;
+  list_remove (&d->lru_elem);
+  list_push_front (&lru_list, &d->lru_elem);
+  lock_release (&dcache_lock);
+}
+
+/* Forgets any lookup of NAME in directory DIR. */
+void
+dcache_invalidate (block_sector_t dir, const char *name)
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+    discard (d);
+  lock_release (&dcache_lock);
+}
+
+/* Forgets every lookup in directory DIR, whose inode is being
+   removed and whose sector may be reused. */
+void
+dcache_purge_dir (block_sector_t dir)
+{
+  size_t i;
+
+  lock_acquire (&dcache_lock);
+  for (i = 0; i < DENTRY_CNT; i++)
+    if (dentries[i].in_use && dentries[i].dir == dir)
+      discard (&dentries[i]);
+  lock_release (&dcache_lock);
+}
@@ -2,26 +2,85 @@
 #include <stdio.h>
 #include <string.h>
 #include <list.h>
+#include <round.h>
+#include <hash.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 #include "threads/synch.h"
 
 
+/* A directory is a hash table of dir_entry slots, probed
+   linearly from the hash of the name.  Slots 0 and 1 hold "." and
+   ".." and are not part of the table.  Removing an entry leaves a
+   tombstone, so that probes for other names carry on past it.  The
+   table is rebuilt twice as large when three quarters of its slots
+   are used or tombstones.  readdir still walks the slots in order. */
+
+/* States of a directory slot.  A never written slot reads as
+   zeros, so it is free. */
+#define SLOT_FREE 0                     /* Never used. */
+#define SLOT_USED 1                     /* Holds an entry. */
+#define SLOT_DELETED 2                  /* Tombstone. */
+
+/* Slots before the hash table, for "." and "..". */
+#define FIXED_SLOTS 2
+
+/* Smallest hash table. */
+#define MIN_TABLE_SLOTS 8
+
 /* A single directory entry. */
 struct dir_entry 
   {
     block_sector_t inode_sector;          /* Sector number of header. */
     char name[NAME_MAX + 1];              /* Null terminated file name. */
-    bool in_use;                          /* In use or free? */
+    uint8_t state;                        /* SLOT_*. */
   };
 
-/* Creates a directory with space for ENTRY_CNT entries in the
-   given SECTOR.  Returns true if successful, false on failure. */
+/* Returns the byte offset of slot SLOT. */
+static inline off_t
+slot_ofs (size_t slot)
+{
+  return slot * sizeof (struct dir_entry);
+}
+
+/* Returns the number of hash table slots in DIR. */
+static size_t
+table_slots (const struct dir *dir)
+{
+  size_t slots = inode_length (dir->inode) / sizeof (struct dir_entry);
+  return slots > FIXED_SLOTS ? slots - FIXED_SLOTS : 0;
+}
+
+/* Returns the slot NAME lives in if it is "." or "..", or -1. */
+static int
+fixed_slot (const char *name)
+{
+  if (!strcmp (name, "."))
+    return 0;
+  if (!strcmp (name, ".."))
+    return 1;
+  return -1;
+}
+
+/* Returns the number of hash table slots needed to hold ENTRY_CNT
+   entries below the load limit. */
+static size_t
+slots_for (size_t entry_cnt)
+{
+  size_t slots = DIV_ROUND_UP (entry_cnt * 4, 3) + 1;
+  return slots > MIN_TABLE_SLOTS ? slots : MIN_TABLE_SLOTS;
+}
+
+/* Creates a directory with space for ENTRY_CNT entries besides
+   "." and ".." in the given SECTOR.  Returns true if successful,
+   false on failure. */
 bool
 dir_create (block_sector_t sector, size_t entry_cnt)
 {
-  return inode_create (sector, entry_cnt * sizeof(struct dir_entry), true);
+  return inode_create (sector, slot_ofs (FIXED_SLOTS + slots_for (entry_cnt)),
+                       true);
 }
 
 /* Opens and returns the directory for the given INODE, of which
@@ -36,11 +95,7 @@ dir_open (struct inode *inode)
   if (inode != NULL)
     {
       dir->inode = inode;
-      if (inode->sector == ROOT_DIR_SECTOR) {
-        dir->pos = 0;
-      } else {
-        dir->pos = 2 * sizeof(struct dir_entry);
-      }
+      dir->pos = slot_ofs (FIXED_SLOTS);
       return dir;
     }
   else
@@ -90,45 +145,166 @@ dir_get_inode (struct dir *dir)
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
    directory entry if OFSP is non-null.
-   otherwise, returns false and ignores EP and OFSP. */
+   otherwise, returns false and ignores EP, and sets *OFSP to the
+   offset of the slot NAME would be added in if OFSP is non-null,
+   or to -1 if the table has no room.
+   DIR's dir_lock must be held, since rehash() rewrites the table
+   in place. */
 static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
   struct dir_entry e;
-  off_t offset;
+  off_t free_ofs = -1;
+  size_t slots, first, i;
+  int fixed;
   
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
+  ASSERT (lock_held_by_current_thread (&dir->inode->dir_lock));
 
-  for (offset = 0; inode_read_at (dir->inode, &e, sizeof e, offset) == sizeof e;
-       offset += sizeof e) {
-    if (e.in_use && !strcmp (name, e.name)) {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = offset;
-        return true;
+  fixed = fixed_slot (name);
+  if (fixed >= 0)
+    {
+      bool found = (inode_read_at (dir->inode, &e, sizeof e, slot_ofs (fixed))
+                    == sizeof e && e.state == SLOT_USED);
+      if (found && ep != NULL)
+        *ep = e;
+      if (ofsp != NULL)
+        *ofsp = slot_ofs (fixed);
+      return found;
     }
-  }
+
+  slots = table_slots (dir);
+  first = slots > 0 ? hash_string (name) % slots : 0;
+  for (i = 0; i < slots; i++)
+    {
+      off_t ofs = slot_ofs (FIXED_SLOTS + (first + i) % slots);
+      if (inode_read_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
+        break;
+      if (e.state == SLOT_USED && !strcmp (name, e.name))
+        {
+          if (ep != NULL)
+            *ep = e;
+          if (ofsp != NULL)
+            *ofsp = ofs;
+          return true;
+        }
+      if (e.state != SLOT_USED && free_ofs < 0)
+        free_ofs = ofs;
+      if (e.state == SLOT_FREE)
+        break;
+    }
+  if (ofsp != NULL)
+    *ofsp = free_ofs;
   return false;
 }
 
+/* Returns the number of slots of DIR's hash table that are in use
+   or tombstones, counting them the first time. */
+static size_t
+occupied_slots (struct dir *dir)
+{
+  struct inode *inode = dir->inode;
+
+  if (inode->dir_occupied < 0)
+    {
+      struct dir_entry e;
+      size_t slots = table_slots (dir);
+      size_t i;
+
+      inode->dir_occupied = 0;
+      for (i = 0; i < slots; i++)
+        if (inode_read_at (inode, &e, sizeof e, slot_ofs (FIXED_SLOTS + i))
+            == sizeof e && e.state != SLOT_FREE)
+          inode->dir_occupied++;
+    }
+  return inode->dir_occupied;
+}
+
+/* Rebuilds DIR's hash table without tombstones, twice as large if
+   more than half of it holds entries.  Returns false if memory or
+   disk allocation fails, leaving the table as it was.  DIR's
+   dir_lock must be held. */
+static bool
+rehash (struct dir *dir)
+{
+  size_t old_slots = table_slots (dir);
+  size_t new_slots = old_slots;
+  size_t live = 0, i;
+  struct dir_entry *old_table, *new_table;
+  off_t new_size;
+  bool success = false;
+
+  ASSERT (lock_held_by_current_thread (&dir->inode->dir_lock));
+
+  old_table = malloc (slot_ofs (old_slots) + 1);
+  if (old_table == NULL)
+    return false;
+  if (inode_read_at (dir->inode, old_table, slot_ofs (old_slots),
+                     slot_ofs (FIXED_SLOTS)) != (uint32_t) slot_ofs (old_slots))
+    goto done;
+  for (i = 0; i < old_slots; i++)
+    if (old_table[i].state == SLOT_USED)
+      live++;
+  if (live * 2 >= old_slots)
+    new_slots = old_slots * 2;
+  if (new_slots < MIN_TABLE_SLOTS)
+    new_slots = MIN_TABLE_SLOTS;
+
+  new_table = calloc (new_slots, sizeof *new_table);
+  if (new_table == NULL)
+    goto done;
+  for (i = 0; i < old_slots; i++)
+    if (old_table[i].state == SLOT_USED)
+      {
+        size_t slot = hash_string (old_table[i].name) % new_slots;
+        while (new_table[slot].state != SLOT_FREE)
+          slot = (slot + 1) % new_slots;
+        new_table[slot] = old_table[i];
+      }
+  new_size = slot_ofs (new_slots);
+  success = (inode_write_at (dir->inode, new_table, new_size,
+                             slot_ofs (FIXED_SLOTS)) == (uint32_t) new_size);
+  if (success)
+    dir->inode->dir_occupied = live;
+  free (new_table);
+
+ done:
+  free (old_table);
+  return success;
+}
+
 /* Searches DIR for a file with the given NAME
    and returns true if one exists, false otherwise.
    On success, sets *INODE to an inode for the file, otherwise to
-   a null pointer.  The caller must close *INODE. */
+   a null pointer.  The caller must close *INODE.
+   Answers from the dentry cache if it can, and caches the result
+   of reading DIR otherwise, whether or not NAME exists.  DIR is
+   read under its dir_lock, which dir_add() holds while rehashing. */
 bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode) 
 {
   struct dir_entry e;
+  block_sector_t sector;
   if (!dir)
     return false;
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
-  if (lookup (dir, name, &e, NULL)) 
-    *inode = inode_open (e.inode_sector);
+  struct inode *dir_inode = dir->inode;
+  if (!dcache_lookup (dir_inode->sector, name, &sector))
+    {
+      lock_acquire (&dir_inode->dir_lock);
+      if (lookup (dir, name, &e, NULL))
+        sector = e.inode_sector;
+      else
+        sector = DCACHE_NEGATIVE;
+      dcache_insert (dir_inode->sector, name, sector);
+      lock_release (&dir_inode->dir_lock);
+    }
+  if (sector != DCACHE_NEGATIVE) 
+    *inode = inode_open (sector);
   else {
     *inode = NULL;
   }
@@ -155,29 +331,29 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector, bool is
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
-  /* Check that NAME is not in use. */
   struct inode *dir_inode = dir->inode;
   lock_acquire (&dir_inode->dir_lock);
 
-  if (lookup(dir, name, NULL, NULL))
-    return false;
-
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-     
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
-  ofs += sizeof e) {
-    if (!e.in_use) {
-      break;
+  /* Check that NAME is not in use, and find the slot for it. */
+  if (lookup (dir, name, NULL, &ofs))
+    goto done;
+  if (fixed_slot (name) < 0)
+    {
+      /* Keep the table below three quarters full. */
+      if ((occupied_slots (dir) + 1) * 4 > table_slots (dir) * 3 || ofs < 0)
+        {
+          if (!rehash (dir))
+            goto done;
+          lookup (dir, name, NULL, &ofs);
+        }
+      if (inode_read_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
+        goto done;
+      if (e.state == SLOT_FREE)
+        dir_inode->dir_occupied++;
     }
-  }
 
   /* Write slot. */
-  e.in_use = true;
+  e.state = SLOT_USED;
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
   if (is_dir) {
@@ -188,8 +364,13 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector, bool is
     dir_close (child_dir);
   }
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-  lock_release (&dir_inode->dir_lock);
+  if (success)
+    dcache_insert (dir_inode->sector, name, inode_sector);
+  else
+    dcache_invalidate (dir_inode->sector, name);
 
+ done:
+  lock_release (&dir_inode->dir_lock);
   return success;
 }
 
@@ -219,12 +400,12 @@ dir_remove (struct dir *dir, const char *name)
   if (inode == NULL)
     goto done;
 
-  /* Erase directory entry. */
-  // lock_acquire (&e.entry_lock);
-  e.in_use = false; 
-  // lock_release(&e.entry_lock);
+  /* Erase directory entry, leaving a tombstone so that lookups of
+     names stored past it still find them. */
+  e.state = SLOT_DELETED;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
     goto done;
+  dcache_insert (dir_inode->sector, name, DCACHE_NEGATIVE);
 
   /* Remove inode. */
   inode_remove (inode);
@@ -249,7 +430,7 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
   while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
     {
       dir->pos += sizeof e;
-      if (e.in_use)
+      if (e.state == SLOT_USED)
         {
           strlcpy (name, e.name, NAME_MAX + 1);
           lock_release (&dir_inode->dir_lock);
@@ -0,0 +1,651 @@
+#include "filesys/extent.h"
+#include <debug.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "filesys/inode.h"
+
+/* Extents that do not fit in the inode live in a B+-tree of
+   depth two: an index block pointing to leaf blocks, each holding
+   extents in file order.  Growing a file appends to the rightmost
+   leaf.  A leaf with no room for the pieces of a split hole is
+   split in two; the tree never gets deeper or rebalances.
+
+   An extent starting at sector 0 is a hole: its sectors have no
+   disk space yet and read as zeros.  Growing a file only appends
+   a hole.  The first write to a hole sector gives it a sector of
+   its own by splitting the hole.  Extents pushed out of a full
+   inode by a split go to the front of the tree.  If the tree has
+   no room either, the hole sector cannot be filled, as if the disk
+   were full.  A sector is never moved once it holds file data.
+
+   Lookups without the inode's alloc_lock only ever read the
+   extents in the inode; the tree is only read and changed with
+   that lock held. */
+
+/* Number of entries in a leaf and in the index block. */
+#define LEAF_EXTENT_CNT 42
+#define INDEX_ENTRY_CNT 63
+
+/* An extent in a leaf, with the first file sector it maps. */
+struct leaf_entry
+  {
+    uint32_t file_sector;       /* First file sector mapped. */
+    struct extent extent;       /* Where those sectors are. */
+  };
+
+/* A leaf block.  Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct extent_leaf
+  {
+    uint32_t cnt;                                   /* Entries in use. */
+    uint32_t unused;
+    struct leaf_entry entries[LEAF_EXTENT_CNT];
+  };
+
+/* A leaf, with the first file sector it maps. */
+struct index_entry
+  {
+    uint32_t file_sector;       /* First file sector mapped. */
+    block_sector_t leaf;        /* Sector of the leaf block. */
+  };
+
+/* The index block.  Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct extent_index
+  {
+    uint32_t cnt;                                   /* Entries in use. */
+    uint32_t unused;
+    struct index_entry entries[INDEX_ENTRY_CNT];
+  };
+
+/* Allocates a zeroed sector, the first free one at or after GOAL,
+   and stores it in *SECTORP, which is only set once the sector is
+   zeroed.  Returns false if the disk is full. */
+static bool
+alloc_zeroed (block_sector_t goal, block_sector_t *sectorp)
+{
+  static char zeros[BLOCK_SECTOR_SIZE];
+  block_sector_t sector;
+
+  if (!free_map_allocate (goal, 1, &sector))
+    return false;
+  buffer_write (fs_device, sector, zeros);
+  barrier ();
+  *sectorp = sector;
+  return true;
+}
+
+/* Allocates a zeroed sector near GOAL for a tree block and stores
+   it in *SECTORP.  Returns false if the disk is full. */
+static bool
+alloc_tree_block (block_sector_t goal, block_sector_t *sectorp)
+{
+  ASSERT (sizeof (struct extent_leaf) == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct extent_index) == BLOCK_SECTOR_SIZE);
+
+  return alloc_zeroed (goal, sectorp);
+}
+
+/* Returns true if sectors starting at START can be added to the
+   end of extent E: both are holes, or START follows E on disk. */
+static bool
+extent_continues (const struct extent *e, block_sector_t start)
+{
+  if (start == 0)
+    return e->start == 0;
+  return e->start != 0 && e->start + e->length == start;
+}
+
+/* Returns the sector OFS sectors into extent E, or 0 if E is a
+   hole, and stores the number of sectors from there to the end of
+   E in *RUN if RUN is non-null. */
+static block_sector_t
+extent_at (const struct extent *e, uint32_t ofs, uint32_t *run)
+{
+  if (run != NULL)
+    *run = e->length - ofs;
+  return e->start != 0 ? e->start + ofs : 0;
+}
+
+/* Returns the number of DISK's extents stored in the inode. */
+static uint32_t
+inline_cnt (const struct inode_disk *disk)
+{
+  return disk->extent_cnt < INODE_EXTENT_CNT
+         ? disk->extent_cnt : INODE_EXTENT_CNT;
+}
+
+/* Returns the index of the last leaf of INDEX, which must have one,
+   that starts at or before file sector SECTOR_OFS, or 0 if none
+   does. */
+static uint32_t
+index_find (const struct extent_index *index, uint32_t sector_ofs)
+{
+  uint32_t lo, hi;
+
+  for (lo = 0, hi = index->cnt; hi - lo > 1; )
+    {
+      uint32_t mid = (lo + hi) / 2;
+      if (index->entries[mid].file_sector <= sector_ofs)
+        lo = mid;
+      else
+        hi = mid;
+    }
+  return lo;
+}
+
+/* Returns the entry of DISK's extent tree that maps file sector
+   SECTOR_OFS, which must be mapped by the tree.  Stores the leaf
+   holding the entry in *LEAFP, pinned for writing if WRITE; the
+   caller must unpin it. */
+static struct leaf_entry *
+tree_find (const struct inode_disk *disk, uint32_t sector_ofs, bool write,
+           struct extent_leaf **leafp)
+{
+  const struct extent_index *index;
+  struct extent_leaf *leaf;
+  block_sector_t leaf_sector;
+  uint32_t lo, hi;
+
+  /* Binary search the index, then the leaf, for the last entry
+     starting at or before SECTOR_OFS. */
+  index = buffer_pin (fs_device, disk->extent_tree);
+  leaf_sector = index->entries[index_find (index, sector_ofs)].leaf;
+  buffer_unpin (index, false);
+
+  if (write)
+    leaf = buffer_pin_write (fs_device, leaf_sector);
+  else
+    leaf = (struct extent_leaf *) buffer_pin (fs_device, leaf_sector);
+  for (lo = 0, hi = leaf->cnt; hi - lo > 1; )
+    {
+      uint32_t mid = (lo + hi) / 2;
+      if (leaf->entries[mid].file_sector <= sector_ofs)
+        lo = mid;
+      else
+        hi = mid;
+    }
+  *leafp = leaf;
+  return &leaf->entries[lo];
+}
+
+/* Appends the extent of LENGTH sectors at START to the tree of
+   DISK, merging it with the last extent when contiguous.  New tree
+   blocks are allocated near GOAL.  Returns false if the tree is
+   full or a tree block cannot be allocated. */
+static bool
+tree_append (struct inode_disk *disk, block_sector_t start, uint32_t length,
+             block_sector_t goal)
+{
+  struct extent_index *index;
+  struct extent_leaf *leaf = NULL;
+  bool success = true;
+
+  if (disk->extent_tree == 0 && !alloc_tree_block (goal, &disk->extent_tree))
+    return false;
+  index = buffer_pin_write (fs_device, disk->extent_tree);
+
+  if (index->cnt > 0)
+    {
+      struct leaf_entry *last;
+
+      /* The last leaf is empty if tree_make_room made room for a
+         split that did not need it after all. */
+      leaf = buffer_pin_write (fs_device, index->entries[index->cnt - 1].leaf);
+      last = &leaf->entries[leaf->cnt - 1];
+      if (leaf->cnt > 0 && extent_continues (&last->extent, start))
+        {
+          last->extent.length += length;
+          goto done;
+        }
+      if (leaf->cnt == LEAF_EXTENT_CNT)
+        {
+          buffer_unpin (leaf, false);
+          leaf = NULL;
+        }
+    }
+
+  if (leaf == NULL)
+    {
+      block_sector_t leaf_sector;
+      if (index->cnt == INDEX_ENTRY_CNT || !alloc_tree_block (goal, &leaf_sector))
+        {
+          success = false;
+          goto done;
+        }
+      index->entries[index->cnt].file_sector = disk->extent_sectors;
+      index->entries[index->cnt].leaf = leaf_sector;
+      index->cnt++;
+      leaf = buffer_pin_write (fs_device, leaf_sector);
+    }
+
+  leaf->entries[leaf->cnt].file_sector = disk->extent_sectors;
+  leaf->entries[leaf->cnt].extent.start = start;
+  leaf->entries[leaf->cnt].extent.length = length;
+  leaf->cnt++;
+  disk->extent_cnt++;
+
+ done:
+  if (leaf != NULL)
+    buffer_unpin (leaf, success);
+  buffer_unpin (index, success);
+  return success;
+}
+
+/* Makes sure the leaf of DISK's tree that maps file sector
+   SECTOR_OFS, or the first leaf if none does, has room for CNT more
+   entries, moving the upper half of a full leaf to a new leaf after
+   it.  Creates the tree if there is none.  New tree blocks are
+   allocated near GOAL.  Returns false if the index or the disk is
+   full. */
+static bool
+tree_make_room (struct inode_disk *disk, uint32_t sector_ofs, uint32_t cnt,
+                block_sector_t goal)
+{
+  struct extent_index *index;
+  struct extent_leaf *leaf, *half;
+  block_sector_t new_sector;
+  uint32_t li, keep;
+  bool changed = false;
+  bool success = true;
+
+  if (disk->extent_tree == 0 && !alloc_tree_block (goal, &disk->extent_tree))
+    return false;
+  index = buffer_pin_write (fs_device, disk->extent_tree);
+  if (index->cnt == 0)
+    {
+      success = alloc_tree_block (goal, &new_sector);
+      if (success)
+        {
+          index->entries[0].file_sector = sector_ofs;
+          index->entries[0].leaf = new_sector;
+          index->cnt = 1;
+        }
+      buffer_unpin (index, success);
+      return success;
+    }
+
+  li = index_find (index, sector_ofs);
+  leaf = buffer_pin_write (fs_device, index->entries[li].leaf);
+  if (leaf->cnt + cnt > LEAF_EXTENT_CNT)
+    {
+      if (index->cnt == INDEX_ENTRY_CNT || !alloc_tree_block (goal, &new_sector))
+        success = false;
+      else
+        {
+          keep = leaf->cnt / 2;
+          half = buffer_pin_write (fs_device, new_sector);
+          half->cnt = leaf->cnt - keep;
+          memcpy (half->entries, leaf->entries + keep,
+                  half->cnt * sizeof *half->entries);
+          buffer_unpin (half, true);
+          memmove (index->entries + li + 2, index->entries + li + 1,
+                   (index->cnt - li - 1) * sizeof *index->entries);
+          index->entries[li + 1].file_sector = leaf->entries[keep].file_sector;
+          index->entries[li + 1].leaf = new_sector;
+          index->cnt++;
+          leaf->cnt = keep;
+          changed = true;
+        }
+    }
+  buffer_unpin (leaf, changed);
+  buffer_unpin (index, changed);
+  return success;
+}
+
+/* Puts the CNT extents in EXTENTS, which map the file sectors from
+   FILE_SECTOR on, in front of all extents in DISK's tree.  New
+   tree blocks are allocated near GOAL.  Returns false if there is
+   no room. */
+static bool
+tree_prepend (struct inode_disk *disk, const struct extent *extents,
+              uint32_t cnt, uint32_t file_sector, block_sector_t goal)
+{
+  struct extent_index *index;
+  struct extent_leaf *leaf;
+  uint32_t i;
+
+  if (!tree_make_room (disk, file_sector, cnt, goal))
+    return false;
+  index = buffer_pin_write (fs_device, disk->extent_tree);
+  leaf = buffer_pin_write (fs_device, index->entries[0].leaf);
+  memmove (leaf->entries + cnt, leaf->entries, leaf->cnt * sizeof *leaf->entries);
+  for (i = 0; i < cnt; i++)
+    {
+      leaf->entries[i].file_sector = file_sector;
+      leaf->entries[i].extent = extents[i];
+      file_sector += extents[i].length;
+    }
+  leaf->cnt += cnt;
+  index->entries[0].file_sector = leaf->entries[0].file_sector;
+  buffer_unpin (leaf, true);
+  buffer_unpin (index, true);
+  return true;
+}
+
+/* Records that the next LENGTH sectors of the file described by
+   DISK are the ones starting at START, or a hole if START is 0.
+   Tree blocks are allocated near GOAL. */
+static bool
+extent_append (struct inode_disk *disk, block_sector_t start, uint32_t length,
+               block_sector_t goal)
+{
+  if (disk->extent_cnt <= INODE_EXTENT_CNT)
+    {
+      struct extent *last = disk->extent_cnt > 0
+                            ? &disk->extents[disk->extent_cnt - 1] : NULL;
+      if (last != NULL && extent_continues (last, start))
+        last->length += length;
+      else if (disk->extent_cnt < INODE_EXTENT_CNT)
+        {
+          disk->extents[disk->extent_cnt].start = start;
+          disk->extents[disk->extent_cnt].length = length;
+          disk->extent_cnt++;
+        }
+      else if (!tree_append (disk, start, length, goal))
+        return false;
+    }
+  else if (!tree_append (disk, start, length, goal))
+    return false;
+
+  disk->extent_sectors += length;
+  return true;
+}
+
+/* Grows the file described by DISK to SECTORS sectors.  The new
+   sectors are a hole, so no data sectors are allocated or written;
+   tree blocks needed to record it are allocated near GOAL.
+   Returns false if the extent tree is full. */
+bool
+extent_grow (struct inode_disk *disk, uint32_t sectors, block_sector_t goal)
+{
+  if (disk->extent_sectors >= sectors)
+    return true;
+  return extent_append (disk, 0, sectors - disk->extent_sectors, goal);
+}
+
+/* Returns true if CNT hole sectors of the file described by DISK
+   can surely be filled, with the file grown once for each, without
+   the tree running out of room.  A fill adds at most two extents
+   and a grow one, and every leaf but the last stays at least about
+   half full. */
+bool
+extent_can_fill (const struct inode_disk *disk, uint32_t cnt)
+{
+  return (disk->extent_cnt + 3 * cnt + 1
+          < INODE_EXTENT_CNT + (INDEX_ENTRY_CNT - 1) * (LEAF_EXTENT_CNT / 2 - 1));
+}
+
+/* Gives hole sector K of the inline extent at index I of DISK,
+   which maps file sectors from POS on, a disk sector, splitting the
+   hole around it: sector DATA if it is not 0, otherwise a zeroed
+   one near GOAL.  Room in the tree for extents the split pushes out
+   of the inode is made before any sector is allocated.  Returns the
+   sector, or -1 if the disk or the tree is full. */
+static block_sector_t
+fill_inline (struct inode_disk *disk, uint32_t i, uint32_t pos, uint32_t k,
+             block_sector_t data, block_sector_t goal)
+{
+  struct extent *e = &disk->extents[i];
+  struct extent split[INODE_EXTENT_CNT + 2];
+  uint32_t n = e->length;
+  uint32_t cnt = inline_cnt (disk);
+  uint32_t need = (k > 0) + (k + 1 < n);
+  uint32_t split_cnt, j;
+  block_sector_t sector;
+
+  if (n == 1 && data != 0)
+    {
+      e->start = data;
+      return data;
+    }
+  if (n == 1)
+    return alloc_zeroed (goal, &e->start) ? e->start : (block_sector_t) -1;
+
+  if (cnt + need > INODE_EXTENT_CNT
+      && !tree_make_room (disk, pos, cnt + need - INODE_EXTENT_CNT, goal))
+    return (block_sector_t) -1;
+  if (data != 0)
+    sector = data;
+  else if (!alloc_zeroed (goal, &sector))
+    return (block_sector_t) -1;
+
+  /* A sector that continues a neighbour on disk joins it instead,
+     which keeps a hole filled in order a single extent. */
+  if (k == 0 && i > 0 && extent_continues (&e[-1], sector))
+    {
+      e[-1].length++;
+      e->length--;
+      return sector;
+    }
+  if (k + 1 == n && i + 1 < cnt && e[1].start == sector + 1)
+    {
+      e[1].start = sector;
+      e[1].length++;
+      e->length--;
+      return sector;
+    }
+
+  /* Lay the pieces out in a copy first, since the last extents may
+     no longer fit in the inode. */
+  memcpy (split, disk->extents, i * sizeof *e);
+  split_cnt = i;
+  if (k > 0)
+    {
+      split[split_cnt].start = 0;
+      split[split_cnt++].length = k;
+    }
+  split[split_cnt].start = sector;
+  split[split_cnt++].length = 1;
+  if (k + 1 < n)
+    {
+      split[split_cnt].start = 0;
+      split[split_cnt++].length = n - k - 1;
+    }
+  memcpy (split + split_cnt, e + 1, (cnt - i - 1) * sizeof *e);
+  split_cnt += cnt - i - 1;
+
+  if (split_cnt > INODE_EXTENT_CNT)
+    {
+      /* The room was made above. */
+      for (pos = 0, j = 0; j < INODE_EXTENT_CNT; j++)
+        pos += split[j].length;
+      if (!tree_prepend (disk, split + INODE_EXTENT_CNT,
+                         split_cnt - INODE_EXTENT_CNT, pos, goal))
+        NOT_REACHED ();
+      split_cnt = INODE_EXTENT_CNT;
+    }
+  memcpy (disk->extents, split, split_cnt * sizeof *e);
+  disk->extent_cnt += need;
+  return sector;
+}
+
+/* Gives hole sector SECTOR_OFS of DISK, mapped by the tree, a disk
+   sector, splitting the hole around it as fill_inline does.
+   Returns the sector, or -1 if the disk or the tree is full. */
+static block_sector_t
+fill_tree (struct inode_disk *disk, uint32_t sector_ofs, block_sector_t data,
+           block_sector_t goal)
+{
+  struct extent_leaf *leaf;
+  struct leaf_entry *e;
+  block_sector_t sector;
+  uint32_t k, n, need;
+
+  e = tree_find (disk, sector_ofs, false, &leaf);
+  k = sector_ofs - e->file_sector;
+  n = e->extent.length;
+  buffer_unpin (leaf, false);
+  need = (k > 0) + (k + 1 < n);
+
+  if (need > 0 && !tree_make_room (disk, sector_ofs, need, goal))
+    return (block_sector_t) -1;
+  if (data != 0)
+    sector = data;
+  else if (!alloc_zeroed (goal, &sector))
+    return (block_sector_t) -1;
+
+  e = tree_find (disk, sector_ofs, true, &leaf);
+  if (n > 1 && k == 0 && e > leaf->entries
+      && extent_continues (&e[-1].extent, sector))
+    {
+      e[-1].extent.length++;
+      e->file_sector++;
+      e->extent.length--;
+    }
+  else if (n > 1 && k + 1 == n && e + 1 < leaf->entries + leaf->cnt
+           && e[1].extent.start == sector + 1)
+    {
+      e[1].file_sector--;
+      e[1].extent.start = sector;
+      e[1].extent.length++;
+      e->extent.length--;
+    }
+  else
+    {
+      memmove (e + 1 + need, e + 1,
+               (leaf->entries + leaf->cnt - e - 1) * sizeof *e);
+      leaf->cnt += need;
+      disk->extent_cnt += need;
+      if (k > 0)
+        {
+          e->extent.start = 0;
+          e->extent.length = k;
+          e++;
+        }
+      e->file_sector = sector_ofs;
+      e->extent.start = sector;
+      e->extent.length = 1;
+      if (k + 1 < n)
+        {
+          e[1].file_sector = sector_ofs + 1;
+          e[1].extent.start = 0;
+          e[1].extent.length = n - k - 1;
+        }
+    }
+  buffer_unpin (leaf, true);
+  return sector;
+}
+
+/* Makes sure file sector SECTOR_OFS of the file described by DISK
+   has a disk sector, giving it a zeroed one if it is in a hole.
+   If DATA is not 0, the hole gets the newly allocated sector DATA
+   instead.  Sectors are otherwise allocated near GOAL.  Returns the
+   sector, or -1 if the disk or the extent tree is full or
+   SECTOR_OFS is past the end of the file. */
+block_sector_t
+extent_fill (struct inode_disk *disk, uint32_t sector_ofs, block_sector_t data,
+             block_sector_t goal)
+{
+  block_sector_t sector;
+  uint32_t pos, i;
+
+  sector = extent_lookup (disk, sector_ofs, NULL);
+  if (sector != 0)
+    return sector;
+
+  for (pos = 0, i = 0; i < inline_cnt (disk); i++)
+    {
+      if (sector_ofs < pos + disk->extents[i].length)
+        return fill_inline (disk, i, pos, sector_ofs - pos, data, goal);
+      pos += disk->extents[i].length;
+    }
+  return fill_tree (disk, sector_ofs, data, goal);
+}
+
+/* Looks up file sector SECTOR_OFS of DISK among the extents stored
+   in the inode only, storing the disk sector in *SECTORP as
+   extent_lookup does.  Returns false if the sector is mapped by the
+   tree instead.  Safe without the inode's alloc_lock: an extent
+   changed meanwhile only yields a wrong sector, never a wild memory
+   access, so a caller that notices the change can look again. */
+bool
+extent_lookup_inline (const struct inode_disk *disk, uint32_t sector_ofs,
+                      block_sector_t *sectorp)
+{
+  uint32_t pos, i;
+
+  if (sector_ofs >= disk->extent_sectors)
+    {
+      *sectorp = (block_sector_t) -1;
+      return true;
+    }
+  for (pos = 0, i = 0; i < inline_cnt (disk); i++)
+    {
+      const struct extent *ie = &disk->extents[i];
+      if (sector_ofs < pos + ie->length)
+        {
+          *sectorp = extent_at (ie, sector_ofs - pos, NULL);
+          return true;
+        }
+      pos += ie->length;
+    }
+  return false;
+}
+
+/* Returns the disk sector holding sector SECTOR_OFS of the file
+   described by DISK, 0 if it is in a hole, or -1 if the file has
+   no such sector.  If RUN is non-null, stores in *RUN the number of
+   sectors of the file from there that are contiguous on disk, or
+   that are all in the hole.  The inode's alloc_lock must be held if
+   the file has an extent tree. */
+block_sector_t
+extent_lookup (const struct inode_disk *disk, uint32_t sector_ofs,
+               uint32_t *run)
+{
+  struct extent_leaf *leaf;
+  struct leaf_entry *e;
+  block_sector_t sector;
+  uint32_t pos, i;
+
+  if (sector_ofs >= disk->extent_sectors)
+    {
+      if (run != NULL)
+        *run = 0;
+      return (block_sector_t) -1;
+    }
+
+  for (pos = 0, i = 0; i < inline_cnt (disk); i++)
+    {
+      const struct extent *ie = &disk->extents[i];
+      if (sector_ofs < pos + ie->length)
+        return extent_at (ie, sector_ofs - pos, run);
+      pos += ie->length;
+    }
+
+  e = tree_find (disk, sector_ofs, false, &leaf);
+  sector = extent_at (&e->extent, sector_ofs - e->file_sector, run);
+  buffer_unpin (leaf, false);
+  return sector;
+}
+
+/* Releases every data and tree sector of the file described by
+   DISK to the free map. */
+void
+extent_release (const struct inode_disk *disk)
+{
+  uint32_t i, j;
+
+  for (i = 0; i < inline_cnt (disk); i++)
+    if (disk->extents[i].start != 0)
+      free_map_release (disk->extents[i].start, disk->extents[i].length);
+
+  if (disk->extent_tree != 0)
+    {
+      const struct extent_index *index = buffer_pin (fs_device,
+                                                     disk->extent_tree);
+      for (i = 0; i < index->cnt; i++)
+        {
+          const struct extent_leaf *leaf = buffer_pin (fs_device,
+                                                       index->entries[i].leaf);
+          for (j = 0; j < leaf->cnt; j++)
+            if (leaf->entries[j].extent.start != 0)
+              free_map_release (leaf->entries[j].extent.start,
+                                leaf->entries[j].extent.length);
+          buffer_unpin (leaf, false);
+          free_map_release (index->entries[i].leaf, 1);
+        }
+      buffer_unpin (index, false);
+      free_map_release (disk->extent_tree, 1);
+    }
+}
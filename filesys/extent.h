@@ -0,0 +1,32 @@
+#ifndef FILESYS_EXTENT_H
+#define FILESYS_EXTENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "devices/block.h"
+
+/* A run of LENGTH physically contiguous sectors starting at START. */
+struct extent
+  {
+    block_sector_t start;       /* First sector of the run. */
+    uint32_t length;            /* Number of sectors. */
+  };
+
+/* Number of extents stored in the on-disk inode itself.  Further
+   extents go to a two-level B+-tree whose root is the inode's
+   extent_tree sector. */
+#define INODE_EXTENT_CNT 61
+
+struct inode_disk;
+
+bool extent_grow (struct inode_disk *, uint32_t sectors, block_sector_t goal);
+bool extent_can_fill (const struct inode_disk *, uint32_t cnt);
+block_sector_t extent_fill (struct inode_disk *, uint32_t sector_ofs,
+                            block_sector_t data, block_sector_t goal);
+block_sector_t extent_lookup (const struct inode_disk *, uint32_t sector_ofs,
+                              uint32_t *run);
+bool extent_lookup_inline (const struct inode_disk *, uint32_t sector_ofs,
+                           block_sector_t *);
+void extent_release (const struct inode_disk *);
+
+#endif /* filesys/extent.h */
@@ -3,12 +3,20 @@
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 
+/* Read-ahead window bounds, in bytes.  A sequential reader starts
+   with the minimum and doubles it on each further sequential read. */
+#define READAHEAD_MIN (4 * BLOCK_SECTOR_SIZE)
+#define READAHEAD_MAX (64 * BLOCK_SECTOR_SIZE)
+
 /* An open file. */
 struct file 
   {
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+    off_t ra_next;              /* Offset a sequential read starts at. */
+    off_t ra_end;               /* End of range queued for read-ahead. */
+    off_t ra_window;            /* Read-ahead window, 0 if not sequential. */
   };
 
 /* Opens a file for the given INODE, of which it takes ownership,
@@ -23,6 +31,9 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->ra_next = 0;
+      file->ra_end = 0;
+      file->ra_window = 0;
       return file;
     }
   else
@@ -63,6 +74,34 @@ file_get_inode (struct file *file)
   return file->inode;
 }
 
+/* Updates FILE's read-ahead state for a read of SIZE bytes at the
+   current position.  If the read continues the previous one, grows
+   the window and, once less than half a window beyond this read
+   is queued, queues up to a full window past it. */
+static void
+file_readahead (struct file *file, off_t size)
+{
+  if (file->pos != file->ra_next)
+    {
+      file->ra_window = 0;
+      file->ra_end = file->pos;
+    }
+  else if (file->ra_window == 0)
+    file->ra_window = READAHEAD_MIN;
+  else if (file->ra_window < READAHEAD_MAX)
+    file->ra_window *= 2;
+  file->ra_next = file->pos + size;
+
+  if (file->ra_window > 0
+      && file->ra_end < file->ra_next + file->ra_window / 2)
+    {
+      off_t start = file->ra_end > file->pos ? file->ra_end : file->pos;
+      off_t end = file->ra_next + file->ra_window;
+      inode_readahead (file->inode, start, end - start);
+      file->ra_end = end;
+    }
+}
+
 /* Reads SIZE bytes from FILE into BUFFER,
    starting at the file's current position.
    Returns the number of bytes actually read,
@@ -71,7 +110,10 @@ file_get_inode (struct file *file)
 off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
-  off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  off_t bytes_read;
+
+  file_readahead (file, size);
+  bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -7,6 +7,7 @@
 #include "filesys/inode.h"
 #include "filesys/directory.h"
 #include "filesys/cache.h"
+#include "filesys/dcache.h"
 #include "threads/synch.h"
 #include "threads/thread.h"
 
@@ -16,19 +17,26 @@ struct block *fs_device;
 static void do_format (void);
 
 /* Initializes the file system module.
-   If FORMAT is true, reformats the file system. */
+   If FORMAT is true, reformats the file system, with extent-based
+   inodes if EXTENTS is true. */
 void
-filesys_init (bool format) 
+filesys_init (bool format, bool extents) 
 {
   fs_device = block_get_role (BLOCK_FILESYS);
   if (fs_device == NULL)
     PANIC ("No file system device found, can't initialize file system.");
 
   inode_init ();
+  dcache_init ();
   free_map_init ();
 
   if (format) 
-    do_format ();
+    {
+      inode_set_extents (extents);
+      do_format ();
+    }
+  else
+    inode_adopt_layout (ROOT_DIR_SECTOR);
 
   free_map_open ();
 }
@@ -38,6 +46,7 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  inode_flush_all ();
   free_map_close ();
   //flush all data 
   buffer_clear();
@@ -131,7 +140,8 @@ filesys_create (const char *name, off_t initial_size)
         return false;
       } else {
         bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
+                  && free_map_allocate (inode_get_inumber (dir_get_inode (dir)),
+                                        1, &inode_sector)
                   && inode_create (inode_sector, initial_size, false)
                   && dir_add (dir, part, inode_sector, false));
         if (!success && inode_sector != 0) 
@@ -191,7 +201,8 @@ filesys_mkdir (const char *name) {
         return false;
       } else {
         bool success = (dir != NULL
-                        && free_map_allocate (1, &inode_sector)
+                        && free_map_allocate (inode_get_inumber (dir_get_inode (dir)),
+                                              1, &inode_sector)
                         && dir_create (inode_sector, 2)
                         && dir_add (dir, part, inode_sector, true));
         if (!success && inode_sector != 0) 
@@ -12,7 +12,7 @@
 /* Block device that contains the file system. */
 struct block *fs_device;
 
-void filesys_init (bool format);
+void filesys_init (bool format, bool extents);
 void filesys_done (void);
 unsigned long long filesys_get_read_cnt (void);
 unsigned long long filesys_get_write_cnt (void);
@@ -1,13 +1,190 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/malloc.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
 static struct lock free_map_lock;    /* Lock to ensure synchronization */
+static struct bitmap *dirty_sectors; /* Free map file sectors changed
+                                        since written, one bit each. */
+
+/* Free sectors can be reserved ahead of allocating them, for data
+   that is already written to the cache but not yet placed on disk.
+   Other allocations leave the reserved count free.  A thread
+   holding reserve_lock allocates the sectors reserved for it. */
+static size_t free_cnt;              /* Free sectors. */
+static size_t reserved_cnt;          /* Free sectors reserved. */
+static struct lock reserve_lock;     /* Held to allocate reserved
+                                        sectors. */
+
+/* The disk is split into allocation groups of as many sectors as
+   one sector of the free map file has bits for.  Each group keeps
+   a count of its free sectors and bounds on the lengths of its free
+   runs at either end and of its longest one, so that allocation can
+   pass over groups where no run of the size wanted starts without
+   scanning them.  The bounds are kept up to date cheaply on every
+   change, and made exact again by a scan of the group that finds no
+   run. */
+#define GROUP_SECTORS (BLOCK_SECTOR_SIZE * 8)
+
+/* Free space of an allocation group.  The run lengths may be too
+   high, never too low. */
+struct group
+  {
+    block_sector_t free;             /* Free sectors. */
+    block_sector_t head;             /* Free sectors at the start. */
+    block_sector_t tail;             /* Free sectors at the end. */
+    block_sector_t longest;          /* Longest run of free sectors. */
+  };
+
+static size_t group_cnt;             /* Number of allocation groups. */
+static struct group *groups;         /* Free space of each group. */
+
+/* Returns the number of sectors in GROUP, which is less than
+   GROUP_SECTORS only for the last group. */
+static size_t
+group_size (size_t group)
+{
+  size_t n = bitmap_size (free_map) - group * GROUP_SECTORS;
+  return n < GROUP_SECTORS ? n : GROUP_SECTORS;
+}
+
+/* Returns the smaller of A and B. */
+static size_t
+min (size_t a, size_t b)
+{
+  return a < b ? a : b;
+}
+
+/* Records that the N sectors starting at SECTOR, all in GROUP, were
+   allocated if ALLOCATED, or released otherwise.  An allocation can
+   only cut the runs at the ends short; a release may join runs, so
+   the bounds are raised as far as that could take them. */
+static void
+update_group (size_t group, size_t sector, size_t n, bool allocated)
+{
+  struct group *g = &groups[group];
+  size_t start = group * GROUP_SECTORS;
+  size_t end = start + group_size (group);
+
+  if (allocated)
+    {
+      g->free -= n;
+      free_cnt -= n;
+      if (sector < start + g->head)
+        g->head = sector - start;
+      if (sector + n > end - g->tail)
+        g->tail = end - (sector + n);
+    }
+  else
+    {
+      g->free += n;
+      free_cnt += n;
+      if (sector <= start + g->head)
+        g->head = g->free;
+      if (sector + n >= end - g->tail)
+        g->tail = g->free;
+      g->longest = 2 * g->longest + n;
+    }
+  g->head = min (g->head, g->free);
+  g->tail = min (g->tail, g->free);
+  g->longest = min (g->longest, g->free);
+}
+
+/* Records that CNT sectors starting at SECTOR were allocated if
+   ALLOCATED, or released otherwise: updates the free space of their
+   groups and marks those groups' free map file sectors dirty.
+   free_map_lock must be held. */
+static void
+note_change (block_sector_t sector, size_t cnt, bool allocated)
+{
+  while (cnt > 0)
+    {
+      size_t group = sector / GROUP_SECTORS;
+      size_t group_end = (group + 1) * GROUP_SECTORS;
+      size_t n = min (cnt, group_end - sector);
+
+      update_group (group, sector, n, allocated);
+      bitmap_mark (dirty_sectors, group);
+      sector += n;
+      cnt -= n;
+    }
+}
+
+/* Returns the first sector of the first run of CNT free sectors
+   that starts in GROUP at or after FROM, or BITMAP_ERROR if there
+   is none.  Goes from one free run to the next a word at a time,
+   never looking further than the run needs.  A scan of the whole
+   group that finds nothing has seen every run in it, and makes the
+   group's bounds exact. */
+static size_t
+find_run (size_t group, size_t from, size_t cnt)
+{
+  struct group *g = &groups[group];
+  size_t start = group * GROUP_SECTORS;
+  size_t end = start + group_size (group);
+  size_t head = 0, tail = 0, longest = 0;
+  size_t pos = from;
+
+  while ((pos = bitmap_next (free_map, pos, end, false)) < end)
+    {
+      size_t run_end = min (pos + cnt, bitmap_size (free_map));
+      size_t last = bitmap_next (free_map, pos, min (run_end, end), true);
+
+      if (last == end && end < run_end)
+        last = bitmap_next (free_map, end, run_end, true);
+      if (last - pos >= cnt)
+        return pos;
+      if (last > end)
+        last = end;
+      if (pos == start)
+        head = last - pos;
+      if (last == end)
+        tail = last - pos;
+      if (last - pos > longest)
+        longest = last - pos;
+      pos = last;
+    }
+  if (from == start)
+    {
+      g->head = head;
+      g->tail = tail;
+      g->longest = longest;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Counts the free space of every group. */
+static void
+count_free (void)
+{
+  size_t group;
+
+  free_cnt = 0;
+  for (group = 0; group < group_cnt; group++)
+    {
+      struct group *g = &groups[group];
+      size_t start = group * GROUP_SECTORS;
+      size_t end = start + group_size (group);
+      size_t pos = start;
+
+      g->free = 0;
+      while ((pos = bitmap_next (free_map, pos, end, false)) < end)
+        {
+          size_t last = bitmap_next (free_map, pos, end, true);
+          g->free += last - pos;
+          pos = last;
+        }
+      free_cnt += g->free;
+      g->head = g->tail = g->longest = g->free;
+      find_run (group, start, g->free + 1);
+    }
+}
 
 /* Initializes the free map. */
 void
@@ -18,26 +195,88 @@ free_map_init (void)
     PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), GROUP_SECTORS);
+  dirty_sectors = bitmap_create (group_cnt);
+  groups = malloc (group_cnt * sizeof *groups);
+  if (dirty_sectors == NULL || groups == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  count_free ();
+  reserved_cnt = 0;
   lock_init (&free_map_lock);
+  lock_init (&reserve_lock);
+}
+
+/* Returns false if no run of CNT free sectors can start in GROUP:
+   its longest run is too short, and so is its free tail together
+   with the free sectors that follow it in the next groups. */
+static bool
+run_may_start (size_t group, size_t cnt)
+{
+  size_t need;
+
+  if (groups[group].longest >= cnt || groups[group].tail >= cnt)
+    return true;
+  if (groups[group].tail == 0)
+    return false;
+  for (need = cnt - groups[group].tail; ++group < group_cnt; )
+    {
+      if (groups[group].head >= need)
+        return true;
+      if (groups[group].free != group_size (group))
+        return false;
+      need -= groups[group].free;
+    }
+  return false;
+}
+
+/* Returns the first sector of the first run of CNT free sectors
+   at or after FROM, or BITMAP_ERROR if there is none.  Only the
+   groups in which such a run may start are scanned. */
+static size_t
+scan_from (size_t from, size_t cnt)
+{
+  size_t group;
+
+  for (group = from / GROUP_SECTORS; group < group_cnt;
+       from = ++group * GROUP_SECTORS)
+    if (run_may_start (group, cnt))
+      {
+        size_t sector = find_run (group, from, cnt);
+        if (sector != BITMAP_ERROR)
+          return sector;
+      }
+  return BITMAP_ERROR;
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
+   the first into *SECTORP.  Takes the first run at or after GOAL,
+   such as the inode's sector or the file's last sector, so that
+   related data stays close on disk; wraps around to the start of
+   the disk if there is none.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available, not counting reserved ones unless
+   between free_map_begin_reserved and free_map_end_reserved.  The
+   change reaches the free map file at the next free_map_flush. */
 bool
-free_map_allocate (size_t cnt, block_sector_t *sectorp)
+free_map_allocate (block_sector_t goal, size_t cnt, block_sector_t *sectorp)
 {
-  lock_acquire (&free_map_lock);
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
+  size_t sector = BITMAP_ERROR;
+  size_t avail;
 
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  lock_acquire (&free_map_lock);
+  avail = free_cnt;
+  if (!lock_held_by_current_thread (&reserve_lock))
+    avail -= reserved_cnt;
+  if (goal >= bitmap_size (free_map))
+    goal = 0;
+  if (cnt <= avail)
+    sector = scan_from (goal, cnt);
+  if (sector == BITMAP_ERROR && goal != 0 && cnt <= avail)
+    sector = scan_from (0, cnt);
+  if (sector != BITMAP_ERROR)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      bitmap_set_multiple (free_map, sector, cnt, true);
+      note_change (sector, cnt, true);
     }
   lock_release (&free_map_lock);
   if (sector != BITMAP_ERROR)
@@ -52,7 +291,68 @@ free_map_release (block_sector_t sector, size_t cnt)
   ASSERT (bitmap_all (free_map, sector, cnt));
   lock_acquire (&free_map_lock);
   bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  note_change (sector, cnt, false);
+  lock_release (&free_map_lock);
+}
+
+/* Reserves CNT free sectors, which other allocations then leave
+   alone, without choosing which.  Returns false if fewer than CNT
+   free sectors are not reserved yet. */
+bool
+free_map_reserve (size_t cnt)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = free_cnt - reserved_cnt >= cnt;
+  if (success)
+    reserved_cnt += cnt;
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Gives up CNT sectors of a reservation made with free_map_reserve,
+   whether or not they have been allocated meanwhile. */
+void
+free_map_unreserve (size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (reserved_cnt >= cnt);
+  reserved_cnt -= cnt;
+  lock_release (&free_map_lock);
+}
+
+/* Lets the current thread allocate reserved sectors until
+   free_map_end_reserved.  It must only take as many as were
+   reserved for it, and give that reservation up before the end.
+   One thread at a time does so. */
+void
+free_map_begin_reserved (void)
+{
+  lock_acquire (&reserve_lock);
+}
+
+/* Ends free_map_begin_reserved. */
+void
+free_map_end_reserved (void)
+{
+  lock_release (&reserve_lock);
+}
+
+/* Writes the sectors of the free map file whose bits changed since
+   they were last written.  Does nothing before the file is open. */
+void
+free_map_flush (void)
+{
+  size_t i;
+
+  lock_acquire (&free_map_lock);
+  if (free_map_file != NULL)
+    for (i = 0; i < bitmap_size (dirty_sectors); i++)
+      if (bitmap_test (dirty_sectors, i)
+          && bitmap_write_part (free_map, free_map_file,
+                                i * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE))
+        bitmap_reset (dirty_sectors, i);
   lock_release (&free_map_lock);
 }
 
@@ -65,13 +365,21 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  count_free ();
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
-  file_close (free_map_file);
+  struct file *file;
+
+  free_map_flush ();
+  lock_acquire (&free_map_lock);
+  file = free_map_file;
+  free_map_file = NULL;
+  lock_release (&free_map_lock);
+  file_close (file);
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -83,10 +391,15 @@ free_map_create (void)
   if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), false))
     PANIC ("free map creation failed");
 
-  /* Write bitmap to file. */
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
+  /* Allocate the file's sectors up front, so that writing the
+     bitmap never has to allocate, and write bitmap to file. */
+  struct inode *inode = inode_open (FREE_MAP_SECTOR);
+  if (inode == NULL || !inode_allocate (inode))
+    PANIC ("free map allocation failed");
+  free_map_file = file_open (inode);
   if (free_map_file == NULL)
     PANIC ("can't open free map");
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  bitmap_set_all (dirty_sectors, false);
 }
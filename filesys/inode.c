@@ -7,43 +7,11 @@
 #include "filesys.h"
 #include "free-map.h"
 #include "cache.h"
+#include "dcache.h"
 #include "threads/malloc.h"
 
 
 
-/* Returns the number of sectors to allocate for an inode SIZE
-   bytes long. */
-static inline uint32_t num_of_direct_block (uint32_t size)
-{
-  if (size < DIRECT_BOUND) {
-    return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
-  } else {
-    return DIRECT_BLOCK_NUMBER;
-  }
-}
-/* Returns the number of singly indirect block number for a file 
-   SIZE bytes long. */
-static inline uint32_t num_of_single_indirect_block (uint32_t size)
-{
-  if (size <= DIRECT_BOUND) {
-    return 0;
-  } else if (size < SINGLE_INDIRECT_BOUND) {
-    return DIV_ROUND_UP (size - DIRECT_BOUND, BLOCK_SECTOR_SIZE*126);
-  } else {
-    return SINGLE_INDIRECT_NUMBER;
-  }
-}
-/* Returns the number of doubly indirect block number for a file 
-   SIZE bytes long. */
-static inline uint32_t num_of_double_indirect_block (uint32_t size)
-{ 
-  if (size <= SINGLE_INDIRECT_BOUND) {
-    return 0;
-  } else {
-    return DIV_ROUND_UP (size - SINGLE_INDIRECT_BOUND, BLOCK_SECTOR_SIZE*126*126);
-  } 
-}
-
 /* Returns true if the INODE is a directory and false if the INODe 
    is a file. */
 inline bool 
@@ -65,125 +33,468 @@ power(uint32_t base, uint32_t expo)
   return rtn;
 }
 
+static block_sector_t alloc_goal (struct inode *, uint32_t sector_ofs);
+
+/* Allocates a zeroed sector, the first free one at or after GOAL,
+   and stores it in *SECTORP.  If INDIRECTION_LEVEL is not -1, the
+   sector is set up as an indirect block of that level with no
+   children.  *SECTORP is only set once the sector is ready, so a
+   lookup without alloc_lock never follows it early.  Returns false
+   if the disk is full. */
+static bool
+alloc_block (block_sector_t *sectorp, int indirection_level,
+             block_sector_t goal)
+{
+  static char zeros[BLOCK_SECTOR_SIZE];
+  block_sector_t sector;
+  if (!free_map_allocate (goal, 1, &sector))
+    return false;
+  buffer_write (fs_device, sector, zeros);
+  if (indirection_level >= 0) {
+    struct indirect_block *iblock = buffer_pin_write (fs_device, sector);
+    iblock->block = sector;
+    iblock->indirection_level = indirection_level;
+    buffer_unpin (iblock, true);
+  }
+  barrier ();
+  *sectorp = sector;
+  return true;
+}
+
 /* Return the block device sector that contains byte offset 
-   BYTE_NUMBER with IBLOCK.*/
-static block_sector_t sector_of_byte(struct indirect_block* iblock, uint32_t byte_number) {
-  if (iblock->indirection_level > 0) {
-    uint32_t index = byte_number / ((power(126,iblock->indirection_level)) * BLOCK_SECTOR_SIZE);
-    struct indirect_block* next_iblock = malloc(BLOCK_SECTOR_SIZE);
-    buffer_read(fs_device, iblock->block_pointers[index], next_iblock);
-    block_sector_t return_value = sector_of_byte(next_iblock, byte_number % (power(126,iblock->indirection_level) * BLOCK_SECTOR_SIZE));
-    free(next_iblock);
-    return return_value;
+   BYTE_NUMBER of the part of a file mapped by the block *SLOT points
+   to: an indirect block of INDIRECTION_LEVEL, or the data sector
+   itself if INDIRECTION_LEVEL is -1.  A pointer of 0 is a hole, so
+   returns 0 if the byte is in one.  If ALLOCATE, fills the holes on
+   the way instead, setting *CHANGED if *SLOT was filled, and returns
+   -1 if the disk is full.  A data hole is given DATA_SECTOR if it is
+   not 0; other holes get the first free sector at or after GOAL. */
+static block_sector_t
+sector_of_byte (block_sector_t *slot, int indirection_level,
+                uint32_t byte_number, bool allocate,
+                block_sector_t data_sector, block_sector_t goal,
+                bool *changed)
+{
+  if (*slot == 0) {
+    if (!allocate)
+      return 0;
+    if (indirection_level < 0 && data_sector != 0)
+      *slot = data_sector;
+    else if (!alloc_block (slot, indirection_level, goal))
+      return (block_sector_t) -1;
+    *changed = true;
   }
-  return iblock->block_pointers[byte_number >> 9];
+  if (indirection_level < 0)
+    return *slot;
+
+  uint32_t span = power(126,indirection_level) * BLOCK_SECTOR_SIZE;
+  struct indirect_block* iblock = allocate
+                                  ? buffer_pin_write(fs_device, *slot)
+                                  : (struct indirect_block *) buffer_pin(fs_device, *slot);
+  bool child_changed = false;
+  block_sector_t return_value = sector_of_byte(&iblock->block_pointers[byte_number / span],
+                                               indirection_level - 1, byte_number % span,
+                                               allocate, data_sector, goal,
+                                               &child_changed);
+  buffer_unpin(iblock, child_changed);
+  return return_value;
+}
+
+/* Marks the start of a change to INODE's sector map, which lookups
+   without alloc_lock notice in map_seq.  INODE's alloc_lock must be
+   held. */
+static void
+map_change_begin (struct inode *inode)
+{
+  inode->map_seq++;
+  barrier ();
+}
+
+/* Marks the end of a change started with map_change_begin. */
+static void
+map_change_end (struct inode *inode)
+{
+  barrier ();
+  inode->map_seq++;
 }
 
 /* Returns the block device sector that contains byte offset POS
-   within INODE.
-   Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   within INODE, or 0 if POS is in a hole.
+   If ALLOCATE, gives a hole at POS a zeroed sector first, or the
+   newly allocated DATA_SECTOR holding its data if that is not 0,
+   and returns -1 if the disk is full.  Allocating callers must hold
+   INODE's alloc_lock and call map_change_begin and map_change_end
+   around the call. */
 static block_sector_t
-byte_to_sector (const struct inode *inode, uint32_t pos) 
+byte_to_sector (struct inode *inode, uint32_t pos, bool allocate,
+                block_sector_t data_sector) 
 {
   ASSERT (inode != NULL);
 
-  struct inode_disk* disk_inode = malloc(BLOCK_SECTOR_SIZE);
-  buffer_read(fs_device, inode->sector, disk_inode);
+  struct inode_disk* disk_inode = &inode->data;
+  bool changed = false;
+  block_sector_t goal = allocate ? alloc_goal (inode, pos / BLOCK_SECTOR_SIZE) : 0;
   block_sector_t return_value;
- 
   
-  if (pos < DIRECT_BOUND) {
-    uint32_t index = pos / BLOCK_SECTOR_SIZE;
-    return_value = disk_inode->direct[index];
-    free(disk_inode);
-    return return_value;
+  if (disk_inode->layout == INODE_LAYOUT_EXTENT) {
+    if (allocate) {
+      return_value = extent_fill (disk_inode, pos / BLOCK_SECTOR_SIZE,
+                                  data_sector, goal);
+      changed = true;
+    } else {
+      return_value = extent_lookup (disk_inode, pos / BLOCK_SECTOR_SIZE, NULL);
+    }
+  } else if (pos < DIRECT_BOUND) {
+    return_value = sector_of_byte(&disk_inode->direct[pos / BLOCK_SECTOR_SIZE], -1,
+                                  0, allocate, data_sector, goal, &changed);
   } else if (pos < SINGLE_INDIRECT_BOUND) {
     uint32_t index = (pos - DIRECT_BOUND) / (BLOCK_SECTOR_SIZE * 126);
-    struct indirect_block* next_iblock = malloc(BLOCK_SECTOR_SIZE);
-    buffer_read(fs_device, disk_inode->single_indirect[index], next_iblock);
-    return_value = sector_of_byte(next_iblock, (pos - DIRECT_BOUND) % (BLOCK_SECTOR_SIZE * 126));
-    free(next_iblock);
-    free(disk_inode);
-    return return_value;
+    return_value = sector_of_byte(&disk_inode->single_indirect[index], 0,
+                                  (pos - DIRECT_BOUND) % (BLOCK_SECTOR_SIZE * 126),
+                                  allocate, data_sector, goal, &changed);
   } else {
     uint32_t index = (pos - SINGLE_INDIRECT_BOUND) / (BLOCK_SECTOR_SIZE * 126 * 126);
-    struct indirect_block* next_iblock = malloc(BLOCK_SECTOR_SIZE);
-    buffer_read(fs_device, disk_inode->double_indirect[index], next_iblock);
-    return_value = sector_of_byte(next_iblock, (pos - SINGLE_INDIRECT_BOUND) % (BLOCK_SECTOR_SIZE * 126 * 126));
-    free(next_iblock);
-    free(disk_inode);
-    return return_value;
+    return_value = sector_of_byte(&disk_inode->double_indirect[index], 1,
+                                  (pos - SINGLE_INDIRECT_BOUND) % (BLOCK_SECTOR_SIZE * 126 * 126),
+                                  allocate, data_sector, goal, &changed);
   }
-  
+  if (changed)
+    inode->data_dirty = true;
+  return return_value;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Returns the sector holding byte POS of INODE, as byte_to_sector
+   does without allocating, but without taking alloc_lock unless
+   the sector map changes under the lookup, in which case it is
+   done again under the lock.  Of the extent layout, only the
+   extents in the inode are read without the lock; the blocks of
+   the extent tree may change in ways a lookup cannot survive. */
+static block_sector_t
+lookup_sector (struct inode *inode, uint32_t pos)
+{
+  unsigned seq = inode->map_seq;
+  block_sector_t sector;
+  bool found = true;
 
-/* Lock for accessing the open_inodes list. */
-static struct lock inode_list_lock;
+  barrier ();
+  if (seq % 2 == 0)
+    {
+      if (inode->data.layout == INODE_LAYOUT_EXTENT)
+        found = extent_lookup_inline (&inode->data, pos / BLOCK_SECTOR_SIZE,
+                                      &sector);
+      else
+        sector = byte_to_sector (inode, pos, false, 0);
+      barrier ();
+      if (found && inode->map_seq == seq)
+        return sector;
+    }
+  lock_acquire (&inode->alloc_lock);
+  sector = byte_to_sector (inode, pos, false, 0);
+  lock_release (&inode->alloc_lock);
+  return sector;
+}
 
-/* Initializes the inode module. */
-void
-inode_init (void) 
+/* Returns where to look for a free sector for file sector
+   SECTOR_OFS of INODE: right after the file's sector before it, or
+   after the inode if that one is in a hole. */
+static block_sector_t
+alloc_goal (struct inode *inode, uint32_t sector_ofs)
 {
-  list_init (&open_inodes);
-  lock_init (&inode_list_lock);
-  buffer_init ();
+  block_sector_t prev = 0;
+  if (sector_ofs > 0)
+    prev = byte_to_sector (inode, (sector_ofs - 1) * BLOCK_SECTOR_SIZE, false, 0);
+  return prev != 0 && prev != (block_sector_t) -1 ? prev + 1 : inode->sector + 1;
 }
-/* Initialize or assign more sectors to the disk_inode. */
-void
-inode_extend (struct inode_disk* disk_inode, uint32_t direct_block_num, 
-                    uint32_t single_indirect_block_num, uint32_t double_indirect_block_num,
-                    uint32_t direct_block_num_old, uint32_t single_indirect_block_num_old, 
-                    uint32_t double_indirect_block_num_old) 
+
+/* Releases SECTOR, and if INDIRECTION_LEVEL is not -1 every block
+   below it, to the free map.  Holes are skipped. */
+static void
+release_block (block_sector_t sector, int indirection_level)
 {
-  static char zeros[BLOCK_SECTOR_SIZE];
-  uint32_t i;
-  for (i = direct_block_num_old; i < direct_block_num; i++) {
-    free_map_allocate(1, &(disk_inode->direct[i]));
-    buffer_write (fs_device, disk_inode->direct[i], zeros);
-  }
-  struct indirect_block* indir_block = malloc(BLOCK_SECTOR_SIZE);
-  for (i = single_indirect_block_num_old; i < single_indirect_block_num; i++) {
-    free_map_allocate(1, &(disk_inode->single_indirect[i]));
-    indir_block->block = disk_inode->single_indirect[i];
-    indir_block->indirection_level = 0;
-    int j;
-    for (j = 0; j < 126; j++) {
-      free_map_allocate(1, &(indir_block->block_pointers[j]));
-      buffer_write (fs_device, indir_block->block_pointers[j], zeros);
+  if (sector == 0)
+    return;
+  if (indirection_level >= 0) {
+    const struct indirect_block *iblock = buffer_pin (fs_device, sector);
+    int i;
+    for (i = 0; i < 126; i++) {
+      release_block (iblock->block_pointers[i], indirection_level - 1);
     }
-    buffer_write (fs_device, disk_inode->single_indirect[i], indir_block);
+    buffer_unpin (iblock, false);
   }
-  struct indirect_block* double_indir_block = malloc(BLOCK_SECTOR_SIZE);
-  for (i = double_indirect_block_num_old; i < double_indirect_block_num; i++) {
-    free_map_allocate(1, &(disk_inode->double_indirect[i]));
-    double_indir_block->block = disk_inode->double_indirect[i];
-    double_indir_block->indirection_level = 1;
-    int k;
-    for (k = 0; k < 126; k++) {
-      free_map_allocate(1, &(double_indir_block->block_pointers[k]));
-      indir_block->block = double_indir_block->block_pointers[k];
-      indir_block->indirection_level = 0;
-      int j;
-      for (j = 0; j < 126; j++) {
-        free_map_allocate(1, &(indir_block->block_pointers[j]));
-        buffer_write (fs_device, indir_block->block_pointers[j], zeros);
-      }
-      buffer_write (fs_device, double_indir_block->block_pointers[k], indir_block);
+  free_map_release (sector, 1);
+}
+
+/* Open inodes, so that opening a single inode twice returns the
+   same `struct inode'.  They are hashed by sector into buckets,
+   each with its own lock, so that opens and closes of different
+   inodes neither scan nor wait for each other. */
+#define OPEN_BUCKET_CNT 64
+
+struct open_bucket
+  {
+    struct list inodes;         /* Open inodes hashed here. */
+    struct lock lock;           /* Lock for accessing INODES. */
+  };
+
+static struct open_bucket open_inodes[OPEN_BUCKET_CNT];
+
+/* Returns the bucket of open inodes for SECTOR. */
+static struct open_bucket *
+open_bucket (block_sector_t sector)
+{
+  return &open_inodes[sector % OPEN_BUCKET_CNT];
+}
+
+/* Layout given to newly created inodes. */
+static uint8_t new_inode_layout = INODE_LAYOUT_INDEXED;
+
+/* Most delayed sectors of all inodes together.  Each keeps a cache
+   block pinned, so this must stay well below the cache size. */
+#define DELAYED_TOTAL_MAX 32
+
+/* Free-map sectors reserved for each delayed sector: its own and
+   up to two indirect or extent tree blocks needed to map it. */
+#define DELAYED_RESERVE 3
+
+/* Number of delayed sectors of all inodes, and lock protecting it. */
+static uint32_t delayed_total;
+static struct lock delayed_lock;
+
+/* Returns the cache block holding file sector SECTOR_OFS of INODE
+   if its allocation is delayed, or NULL.  INODE's alloc_lock must
+   be held. */
+static uint8_t *
+delayed_block (struct inode *inode, uint32_t sector_ofs)
+{
+  if (sector_ofs - inode->delayed_start < inode->delayed_cnt)
+    return inode->delayed[sector_ofs - inode->delayed_start];
+  return NULL;
+}
+
+/* Forgets the first CNT delayed sectors of INODE. */
+static void
+forget_delayed (struct inode *inode, uint32_t cnt)
+{
+  inode->delayed_cnt -= cnt;
+  memmove (inode->delayed, inode->delayed + cnt,
+           inode->delayed_cnt * sizeof *inode->delayed);
+  inode->delayed_start += cnt;
+  lock_acquire (&delayed_lock);
+  delayed_total -= cnt;
+  lock_release (&delayed_lock);
+  inode->dir_occupied = -1;
+}
+
+/* Discards the delayed sectors of INODE and their reservations. */
+static void
+drop_delayed (struct inode *inode)
+{
+  uint32_t i;
+
+  for (i = 0; i < inode->delayed_cnt; i++)
+    buffer_drop_anon (inode->delayed[i]);
+  free_map_unreserve (inode->delayed_cnt * DELAYED_RESERVE);
+  forget_delayed (inode, inode->delayed_cnt);
+}
+
+/* Gives the delayed sectors of INODE disk sectors out of their
+   reservations, in one run right after the sector before them in
+   the file if the free map allows, and hands their cache blocks
+   over to those sectors.  Returns false if some could not be
+   mapped, which then stay delayed.  INODE's alloc_lock must be
+   held. */
+static bool
+resolve_delayed (struct inode *inode)
+{
+  uint32_t cnt = inode->delayed_cnt;
+  uint32_t done = 0;
+  bool success = true;
+  block_sector_t goal;
+  block_sector_t start;
+
+  if (cnt == 0)
+    return true;
+  goal = alloc_goal (inode, inode->delayed_start);
+
+  free_map_begin_reserved ();
+  while (done < cnt && success)
+    {
+      uint32_t n = cnt - done;
+      uint32_t i;
+
+      /* Settle for shorter runs as free space gets fragmented. */
+      while (n > 0 && !free_map_allocate (goal, n, &start))
+        n /= 2;
+      if (n == 0)
+        {
+          success = false;
+          break;
+        }
+
+      /* Lookups without alloc_lock wait out the change until the
+         data is in place, so none reads the sector unwritten.  A
+         sector is only handed the data once the file points to it. */
+      for (i = 0; i < n && success; i++)
+        {
+          uint32_t pos = (inode->delayed_start + done + i) * BLOCK_SECTOR_SIZE;
+          map_change_begin (inode);
+          success = byte_to_sector (inode, pos, true, start + i)
+                    != (block_sector_t) -1;
+          if (success)
+            buffer_unpin_anon (inode->delayed[done + i], fs_device, start + i);
+          map_change_end (inode);
+        }
+      if (!success)
+        {
+          /* Nothing is cached for the sectors not mapped. */
+          i--;
+          free_map_release (start + i, n - i);
+        }
+      goal = start + n;
+      done += i;
     }
-    buffer_write (fs_device, disk_inode->double_indirect[i], double_indir_block);
-  }
+  free_map_unreserve (done * DELAYED_RESERVE);
+  free_map_end_reserved ();
+  forget_delayed (inode, done);
+  return success;
+}
+
+/* Keeps file sector SECTOR_OFS of INODE, which is in a hole, in a
+   pinned cache block instead of giving it a disk sector, so that a
+   run of appended sectors is allocated in one piece later.  Space
+   to allocate it is reserved now.  Returns the zeroed block, or
+   NULL if the sector cannot be delayed; any delayed sectors are
+   then allocated first.  INODE's alloc_lock must be held. */
+static uint8_t *
+delay_sector (struct inode *inode, uint32_t sector_ofs)
+{
+  bool room;
+
+  if (inode->delayed_cnt > 0
+      && (sector_ofs != inode->delayed_start + inode->delayed_cnt
+          || inode->delayed_cnt == INODE_DELAYED_MAX
+          || delayed_total >= DELAYED_TOTAL_MAX)
+      && !resolve_delayed (inode))
+    return NULL;
+
+  room = (inode->data.layout != INODE_LAYOUT_EXTENT
+          || extent_can_fill (&inode->data, inode->delayed_cnt + 1));
+  if (room)
+    {
+      lock_acquire (&delayed_lock);
+      room = delayed_total < DELAYED_TOTAL_MAX;
+      if (room)
+        delayed_total++;
+      lock_release (&delayed_lock);
+    }
+  if (room && !free_map_reserve (DELAYED_RESERVE))
+    {
+      lock_acquire (&delayed_lock);
+      delayed_total--;
+      lock_release (&delayed_lock);
+      room = false;
+    }
+  if (!room)
+    {
+      resolve_delayed (inode);
+      return NULL;
+    }
+
+  if (inode->delayed_cnt == 0)
+    inode->delayed_start = sector_ofs;
+  inode->delayed[inode->delayed_cnt] = buffer_pin_anon ();
+  return inode->delayed[inode->delayed_cnt++];
+}
+
+/* Copies SIZE bytes at POS of INODE, within one sector that was
+   found in a hole, into BUFFER: zeros, or the data of a delayed
+   sector.  Returns 0, or the sector if it got one meanwhile and
+   the caller must read it instead. */
+static block_sector_t
+read_hole (struct inode *inode, uint32_t pos, uint8_t *buffer, uint32_t size)
+{
+  block_sector_t sector = 0;
+  uint8_t *data;
+
+  lock_acquire (&inode->alloc_lock);
+  data = delayed_block (inode, pos / BLOCK_SECTOR_SIZE);
+  if (data != NULL)
+    memcpy (buffer, data + pos % BLOCK_SECTOR_SIZE, size);
+  else
+    sector = byte_to_sector (inode, pos, false, 0);
+  if (data == NULL && sector == 0)
+    memset (buffer, 0, size);
+  lock_release (&inode->alloc_lock);
+  return sector;
+}
 
-  free(indir_block);
-  free(double_indir_block);
+/* Writes SIZE bytes from BUFFER at POS of INODE, within one sector
+   that was found in a hole.  The data goes to a delayed sector if
+   its space can be reserved; otherwise the sector is allocated now
+   and returned for the caller to write.  Returns 0 if the data was
+   written, or -1 if the disk is full. */
+static block_sector_t
+write_hole (struct inode *inode, uint32_t pos, const uint8_t *buffer,
+            uint32_t size)
+{
+  block_sector_t sector = 0;
+  uint8_t *data;
+
+  lock_acquire (&inode->alloc_lock);
+  data = delayed_block (inode, pos / BLOCK_SECTOR_SIZE);
+  if (data == NULL)
+    sector = byte_to_sector (inode, pos, false, 0);
+  if (data == NULL && sector == 0)
+    {
+      data = delay_sector (inode, pos / BLOCK_SECTOR_SIZE);
+      if (data == NULL)
+        {
+          map_change_begin (inode);
+          sector = byte_to_sector (inode, pos, true, 0);
+          map_change_end (inode);
+        }
+    }
+  if (data != NULL)
+    memcpy (data + pos % BLOCK_SECTOR_SIZE, buffer, size);
+  lock_release (&inode->alloc_lock);
+  return sector;
+}
+
+/* Initializes the inode module. */
+void
+inode_init (void) 
+{
+  size_t i;
 
+  for (i = 0; i < OPEN_BUCKET_CNT; i++)
+    {
+      list_init (&open_inodes[i].inodes);
+      lock_init (&open_inodes[i].lock);
+    }
+  delayed_total = 0;
+  lock_init (&delayed_lock);
+  buffer_init ();
 }
 
+/* Makes inodes created from now on map their data with extents if
+   EXTENTS is true, or with direct and indirect blocks otherwise.
+   Used when formatting. */
+void
+inode_set_extents (bool extents)
+{
+  new_inode_layout = extents ? INODE_LAYOUT_EXTENT : INODE_LAYOUT_INDEXED;
+}
 
+/* Makes inodes created from now on use the layout of the inode at
+   SECTOR, so that a file system keeps the layout it was formatted
+   with. */
+void
+inode_adopt_layout (block_sector_t sector)
+{
+  const struct inode_disk *disk_inode = buffer_pin (fs_device, sector);
+  new_inode_layout = disk_inode->layout;
+  buffer_unpin (disk_inode, false);
+}
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
    device.
@@ -204,46 +515,68 @@ inode_create (block_sector_t sector, uint32_t length, bool is_dir)
 
   disk_inode = calloc (1, sizeof *disk_inode);
   if (disk_inode != NULL) {
-    uint32_t direct_block_num = num_of_direct_block (length);
-    uint32_t single_indirect_block_num = num_of_single_indirect_block (length);
-    uint32_t double_indirect_block_num = num_of_double_indirect_block (length);
     disk_inode->length = length;
     disk_inode->magic = INODE_MAGIC;
     disk_inode->is_dir = is_dir;
+    disk_inode->layout = new_inode_layout;
 
-    inode_extend (disk_inode, direct_block_num, single_indirect_block_num, 
-                  double_indirect_block_num, 0, 0, 0);
+    /* The data starts out as a hole; sectors are allocated as they
+       are first written. */
+    if (disk_inode->layout == INODE_LAYOUT_EXTENT)
+      success = extent_grow (disk_inode, DIV_ROUND_UP (length, BLOCK_SECTOR_SIZE),
+                             sector + 1);
+    else
+      success = true;
 
-    buffer_write(fs_device, sector, disk_inode);
+    if (success)
+      buffer_write(fs_device, sector, disk_inode);
 
     free (disk_inode);
-    success = true;
   }
   return success;
 }
 
+/* Gives every sector of INODE that is in a hole a zeroed disk
+   sector.  Returns false if the disk is full. */
+bool
+inode_allocate (struct inode *inode)
+{
+  uint32_t ofs;
+  bool success = true;
+
+  lock_acquire (&inode->alloc_lock);
+  success = resolve_delayed (inode);
+  map_change_begin (inode);
+  for (ofs = 0; ofs < inode_length (inode) && success; ofs += BLOCK_SECTOR_SIZE)
+    success = byte_to_sector (inode, ofs, true, 0) != (block_sector_t) -1;
+  map_change_end (inode);
+  lock_release (&inode->alloc_lock);
+  return success;
+}
+
 /* Reads an inode from SECTOR
    and returns a `struct inode' that contains it.
    Returns a null pointer if memory allocation fails. */
 struct inode *
 inode_open (block_sector_t sector)
 {
+  struct open_bucket *bucket = open_bucket (sector);
   struct list_elem *e;
   struct inode *inode;
-  lock_acquire (&inode_list_lock);
+  lock_acquire (&bucket->lock);
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
+  for (e = list_begin (&bucket->inodes); e != list_end (&bucket->inodes);
        e = list_next (e)) 
     {
       inode = list_entry (e, struct inode, elem);
       if (inode->sector == sector) 
         {
           if (inode->removed) {
-            lock_release (&inode_list_lock);
+            lock_release (&bucket->lock);
             return NULL;
           }
           inode_reopen (inode);
-          lock_release (&inode_list_lock);
+          lock_release (&bucket->lock);
           return inode; 
         }
     }
@@ -251,12 +584,12 @@ inode_open (block_sector_t sector)
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL) {
-    lock_release (&inode_list_lock);
+    lock_release (&bucket->lock);
     return NULL;
   }
 
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  list_push_front (&bucket->inodes, &inode->elem);
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
@@ -264,11 +597,14 @@ inode_open (block_sector_t sector)
   lock_init (&(inode->size_lock));
   lock_init (&(inode->dir_lock));
   lock_init (&(inode->inode_lock));
-  struct inode_disk* disk_inode = malloc(BLOCK_SECTOR_SIZE);
-  buffer_read(fs_device, sector, disk_inode);
-  inode->is_dir = disk_inode->is_dir;
-  free(disk_inode);
-  lock_release (&inode_list_lock);
+  lock_init (&(inode->alloc_lock));
+  inode->map_seq = 0;
+  buffer_read(fs_device, sector, &inode->data);
+  inode->data_dirty = false;
+  inode->delayed_cnt = 0;
+  inode->dir_occupied = -1;
+  inode->is_dir = inode->data.is_dir;
+  lock_release (&bucket->lock);
   return inode;
 }
 
@@ -301,60 +637,50 @@ inode_close (struct inode *inode)
   if (inode == NULL)
     return;
 
-  lock_acquire(&inode_list_lock);
+  struct open_bucket *bucket = open_bucket (inode->sector);
+  lock_acquire (&bucket->lock);
   lock_acquire(&inode->inode_lock);
   /* Release resources if this was the last opener. */
   if (--inode->open_cnt == 0)
     {
+      /* Delayed data of a removed inode is never written, nor is
+         any that cannot be mapped. */
+      lock_acquire (&inode->alloc_lock);
+      if (inode->removed || !resolve_delayed (inode))
+        drop_delayed (inode);
+      lock_release (&inode->alloc_lock);
+      /* Write back before leaving the inode list, so that an
+         inode_open racing with us reads the inode up to date. */
+      if (!inode->removed && inode->data_dirty)
+        buffer_write (fs_device, inode->sector, &inode->data);
       /* Remove from inode list and release lock. */
       list_remove (&inode->elem);
-      lock_release (&inode_list_lock);
+      lock_release (&bucket->lock);
+      /* Lookups in a removed directory must not outlive its sector. */
+      if (inode->removed && inode->is_dir)
+        dcache_purge_dir (inode->sector);
       /* Deallocate blocks if removed. */
-      if (inode->removed) {
-        struct inode_disk* disk_inode = malloc(BLOCK_SECTOR_SIZE);
-        buffer_read(fs_device, inode->sector, disk_inode);
-        uint32_t length = disk_inode->length;
-        
-        uint32_t direct_block_num = num_of_direct_block (length);
-        uint32_t single_indirect_block_num = num_of_single_indirect_block (length);
-        uint32_t double_indirect_block_num = num_of_double_indirect_block (length);
-
+      if (inode->removed && inode->data.layout == INODE_LAYOUT_EXTENT) {
+        extent_release (&inode->data);
+        free_map_release(inode->sector, 1);
+      } else if (inode->removed) {
+        const struct inode_disk* disk_inode = &inode->data;
         uint32_t i;
-        for (i = 0; i < direct_block_num; i++) {
-          free_map_release(disk_inode->direct[i], 1);
+        for (i = 0; i < DIRECT_BLOCK_NUMBER; i++) {
+          release_block (disk_inode->direct[i], -1);
         }
-        struct indirect_block *indir_block = malloc(BLOCK_SECTOR_SIZE);
-        for (i = 0; i < single_indirect_block_num; i++) {
-          buffer_read (fs_device, disk_inode->single_indirect[i], indir_block);
-          int j;
-          for (j = 0; j < 126; j++) {
-            free_map_release(indir_block->block_pointers[j], 1);
-          }
-          free_map_release(disk_inode->single_indirect[i], 1);
+        for (i = 0; i < SINGLE_INDIRECT_NUMBER; i++) {
+          release_block (disk_inode->single_indirect[i], 0);
         }
-        struct indirect_block *double_indir_block = malloc(BLOCK_SECTOR_SIZE);
-        for (i = 0; i < double_indirect_block_num; i++) {
-          buffer_read (fs_device, disk_inode->double_indirect[i], double_indir_block);
-          int k;
-          for (k = 0; k < 126; k++) {
-            buffer_read (fs_device, double_indir_block->block_pointers[k], indir_block);
-            int j;
-            for (j = 0; j < 126; j++) {
-              free_map_release(indir_block->block_pointers[j], 1);
-            }
-            free_map_release(double_indir_block->block_pointers[k], 1);
-          }
-          free_map_release(disk_inode->double_indirect[i], 1);
+        for (i = 0; i < DOUBLE_INDIRECT_NUMBER; i++) {
+          release_block (disk_inode->double_indirect[i], 1);
         }
         free_map_release(inode->sector, 1);
-        free(disk_inode);
-        free(indir_block);
-        free(double_indir_block);
       }
       lock_release (&inode->inode_lock);
       free (inode); 
     } else {
-      lock_release (&inode_list_lock);
+      lock_release (&bucket->lock);
       lock_release (&inode->inode_lock);
     }
 }
@@ -378,12 +704,11 @@ inode_read_at (struct inode *inode, void *buffer_, uint32_t size, uint32_t offse
 {
   uint8_t *buffer = buffer_;
   uint32_t bytes_read = 0;
-  uint8_t *bounce = NULL;
 
   while (size > 0) 
     {
       /* Disk sector to read, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      block_sector_t sector_idx = lookup_sector (inode, offset);
       uint32_t sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -396,23 +721,22 @@ inode_read_at (struct inode *inode, void *buffer_, uint32_t size, uint32_t offse
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+      if (sector_idx == 0)
+        sector_idx = read_hole (inode, offset, buffer + bytes_read, chunk_size);
+      if (sector_idx == 0)
+        {
+          /* Read from a hole or a delayed sector above. */
+        }
+      else if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
         {
           /* Read full sector directly into caller's buffer. */
           buffer_read (fs_device, sector_idx, buffer + bytes_read);
         }
       else 
         {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          buffer_read (fs_device, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
+          /* Copy only the part we need out of the cache. */
+          buffer_read_range (fs_device, sector_idx, sector_ofs, chunk_size,
+                             buffer + bytes_read);
         }
       
       /* Advance. */
@@ -420,11 +744,44 @@ inode_read_at (struct inode *inode, void *buffer_, uint32_t size, uint32_t offse
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
 
   return bytes_read;
 }
 
+/* Queues the sectors holding SIZE bytes of INODE starting at
+   OFFSET for asynchronous read into the buffer cache, stopping at
+   end of file.  Runs of physically contiguous sectors are queued
+   as a single request. */
+void
+inode_readahead (struct inode *inode, uint32_t offset, uint32_t size)
+{
+  uint32_t length = inode_length (inode);
+  block_sector_t run_start = 0;
+  block_sector_t run_cnt = 0;
+  uint32_t end;
+
+  if (offset >= length)
+    return;
+  end = size < length - offset ? offset + size : length;
+
+  for (offset -= offset % BLOCK_SECTOR_SIZE; offset < end;
+       offset += BLOCK_SECTOR_SIZE)
+    {
+      block_sector_t sector_idx = lookup_sector (inode, offset);
+      if (run_cnt > 0 && sector_idx == run_start + run_cnt)
+        run_cnt++;
+      else
+        {
+          if (run_cnt > 0)
+            buffer_prefetch (fs_device, run_start, run_cnt);
+          run_start = sector_idx;
+          run_cnt = sector_idx != 0;
+        }
+    }
+  if (run_cnt > 0)
+    buffer_prefetch (fs_device, run_start, run_cnt);
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
    less than SIZE if end of file is reached or an error occurs.
@@ -436,7 +793,6 @@ inode_write_at (struct inode *inode, const void *buffer_, uint32_t size,
 {
   const uint8_t *buffer = buffer_;
   uint32_t bytes_written = 0;
-  uint8_t *bounce = NULL;
 
   if (inode->deny_write_cnt)
     return 0;
@@ -444,8 +800,6 @@ inode_write_at (struct inode *inode, const void *buffer_, uint32_t size,
 
   uint32_t length_inode = inode_length (inode);
   uint32_t old_length = length_inode;
-  struct inode_disk* disk_inode = malloc (BLOCK_SECTOR_SIZE);
-  buffer_read (fs_device, inode->sector, disk_inode);
   if ((size + offset) > length_inode) {
     lock_acquire (&inode->size_lock);
     length_inode = inode_length (inode);
@@ -453,17 +807,22 @@ inode_write_at (struct inode *inode, const void *buffer_, uint32_t size,
     if ((size + offset) <= length_inode) {
       lock_release(&inode->size_lock);
     } else {
-      uint32_t direct_block_num = num_of_direct_block (size + offset);
-      uint32_t single_indirect_block_num = num_of_single_indirect_block (size + offset);
-      uint32_t double_indirect_block_num = num_of_double_indirect_block (size + offset);
-      uint32_t direct_block_num_old = num_of_direct_block (length_inode);
-      uint32_t single_indirect_block_num_old = num_of_single_indirect_block (length_inode);
-      uint32_t double_indirect_block_num_old = num_of_double_indirect_block (length_inode);
-
-      inode_extend (disk_inode, direct_block_num, single_indirect_block_num, 
-                    double_indirect_block_num, direct_block_num_old, 
-                    single_indirect_block_num_old, double_indirect_block_num_old);
-      buffer_write (fs_device, inode->sector, disk_inode);
+      /* The new part of the file is a hole until written below.
+         Growing rewrites extents that filling a hole also changes. */
+      if (inode->data.layout == INODE_LAYOUT_EXTENT) {
+        bool grown;
+        lock_acquire (&inode->alloc_lock);
+        map_change_begin (inode);
+        grown = extent_grow (&inode->data, DIV_ROUND_UP (size + offset, BLOCK_SECTOR_SIZE),
+                             inode->sector + 1);
+        map_change_end (inode);
+        lock_release (&inode->alloc_lock);
+        if (!grown) {
+          lock_release (&inode->size_lock);
+          return 0;
+        }
+      }
+      inode->data_dirty = true;
       length_inode = size + offset;
     }
   }
@@ -472,7 +831,7 @@ inode_write_at (struct inode *inode, const void *buffer_, uint32_t size,
   while (size > 0) 
     {
       /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      block_sector_t sector_idx = lookup_sector (inode, offset);
       uint32_t sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -484,31 +843,26 @@ inode_write_at (struct inode *inode, const void *buffer_, uint32_t size,
       uint32_t chunk_size = size < min_left ? size : min_left;
       if (chunk_size <= 0)
         break;
+      if (sector_idx == 0)
+        sector_idx = write_hole (inode, offset, buffer + bytes_written, chunk_size);
+      if (sector_idx == (block_sector_t) -1)
+        break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+      if (sector_idx == 0)
+        {
+          /* Written to a delayed sector above. */
+        }
+      else if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
         {
           /* Write full sector directly to disk. */
           buffer_write (fs_device, sector_idx, buffer + bytes_written);
         }
       else 
         {
-          /* We need a bounce buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left) 
-            buffer_read (fs_device, sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          buffer_write (fs_device, sector_idx, bounce);
+          /* Update only the bytes we cover; the cache supplies the
+             rest of the sector. */
+          buffer_write_range (fs_device, sector_idx, sector_ofs, chunk_size,
+                              buffer + bytes_written);
         }
 
       /* Advance. */
@@ -516,13 +870,11 @@ inode_write_at (struct inode *inode, const void *buffer_, uint32_t size,
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  disk_inode->length = length_inode;
   if (old_length < length_inode) {
-    buffer_write (fs_device, inode->sector, disk_inode);
+    /* Short of disk space, the file only grows as far as written. */
+    inode->data.length = offset > old_length ? offset : old_length;
     lock_release (&inode->size_lock);
   }
-  free (disk_inode);
-  free (bounce);
   return bytes_written;
 }
 
@@ -555,9 +907,64 @@ inode_allow_write (struct inode *inode)
 uint32_t
 inode_length (const struct inode *inode)
 {
-  struct inode_disk* disk_inode = malloc (BLOCK_SECTOR_SIZE);
-  buffer_read (fs_device, inode->sector, disk_inode);
-  uint32_t length = disk_inode->length;
-  free (disk_inode);
-  return length;
+  return inode->data.length;
+}
+
+/* Returns the number of runs of contiguous disk sectors that hold
+   INODE's data, once its delayed sectors are allocated.  Holes do
+   not count. */
+uint32_t
+inode_fragment_cnt (struct inode *inode)
+{
+  block_sector_t prev = 0;
+  uint32_t cnt = 0;
+  uint32_t pos;
+
+  lock_acquire (&inode->alloc_lock);
+  resolve_delayed (inode);
+  for (pos = 0; pos < inode_length (inode); pos += BLOCK_SECTOR_SIZE)
+    {
+      block_sector_t sector = byte_to_sector (inode, pos, false, 0);
+      if (sector != 0 && (prev == 0 || sector != prev + 1))
+        cnt++;
+      prev = sector;
+    }
+  lock_release (&inode->alloc_lock);
+  return cnt;
+}
+
+/* Allocates the delayed sectors of every open inode and writes the
+   cached on-disk inode of every one that changed back to the buffer
+   cache.  An inode being allocated to or whose size is being
+   changed right now is skipped; it is written by a later call or
+   when it is closed. */
+void
+inode_flush_all (void)
+{
+  struct open_bucket *bucket;
+  struct list_elem *e;
+
+  for (bucket = open_inodes; bucket < open_inodes + OPEN_BUCKET_CNT;
+       bucket++)
+    {
+      lock_acquire (&bucket->lock);
+      for (e = list_begin (&bucket->inodes); e != list_end (&bucket->inodes);
+           e = list_next (e))
+        {
+          struct inode *inode = list_entry (e, struct inode, elem);
+          if (inode->delayed_cnt > 0
+              && lock_try_acquire (&inode->alloc_lock))
+            {
+              resolve_delayed (inode);
+              lock_release (&inode->alloc_lock);
+            }
+          if (inode->data_dirty && lock_try_acquire (&inode->size_lock))
+            {
+              inode->data_dirty = false;
+              buffer_write (fs_device, inode->sector, &inode->data);
+              lock_release (&inode->size_lock);
+            }
+        }
+      lock_release (&bucket->lock);
+    }
 }
\ No newline at end of file
@@ -5,7 +5,7 @@
 #include <list.h>
 #include "filesys/off_t.h"
 #include "devices/block.h"
-#include "filesys/inode.h"
+#include "filesys/extent.h"
 #include "threads/synch.h"
 
 #define INODE_MAGIC 0x494e4f44
@@ -20,15 +20,34 @@ static const uint32_t DIRECT_BOUND = DIRECT_BLOCK_NUMBER * BLOCK_SECTOR_SIZE;
 static const uint32_t SINGLE_INDIRECT_BOUND = DIRECT_BLOCK_NUMBER * BLOCK_SECTOR_SIZE 
                                          + SINGLE_INDIRECT_NUMBER * BLOCK_SECTOR_SIZE * 126;
 
+/* Most appended sectors an inode keeps in the buffer cache before
+   giving them disk sectors. */
+#define INODE_DELAYED_MAX 16
+
+/* Ways an on-disk inode can map its data. */
+#define INODE_LAYOUT_INDEXED 0  /* Direct and indirect block pointers. */
+#define INODE_LAYOUT_EXTENT 1   /* Extents, see filesys/extent.c. */
+
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk {
     uint32_t length;                                            /* File size in bytes. */
     unsigned magic;                                             /* Magic number. */
     bool is_dir;
-    block_sector_t direct[DIRECT_BLOCK_NUMBER];                 /* Direct blocks. */
-    block_sector_t single_indirect[SINGLE_INDIRECT_NUMBER];     /* Singly indirect blocks. */ 
-    block_sector_t double_indirect[DOUBLE_INDIRECT_NUMBER];     /* Doubly indirect blocks. */
+    uint8_t layout;                                             /* INODE_LAYOUT_*. */
+    union {
+      struct {
+        block_sector_t direct[DIRECT_BLOCK_NUMBER];             /* Direct blocks. */
+        block_sector_t single_indirect[SINGLE_INDIRECT_NUMBER]; /* Singly indirect blocks. */ 
+        block_sector_t double_indirect[DOUBLE_INDIRECT_NUMBER]; /* Doubly indirect blocks. */
+      };
+      struct {
+        uint32_t extent_cnt;                                    /* Extents, inline and in tree. */
+        uint32_t extent_sectors;                                /* Sectors the extents cover. */
+        block_sector_t extent_tree;                             /* Extent tree index, or 0. */
+        struct extent extents[INODE_EXTENT_CNT];                /* First extents. */
+      };
+    };
 };
 
 struct indirect_block {
@@ -49,22 +68,38 @@ struct inode
     struct lock size_lock;     /* This lock is for file extension. */
     bool is_dir;               /* True if this inode represents a directory*/
     struct lock dir_lock;      /* Lock to control directory access*/ 
+    int dir_occupied;          /* Directory hash slots used or deleted,
+                                  -1 if not counted yet. */
     struct lock inode_lock;    /* Lock to protect open_cnt, removed, deny_write_cnt. */        
+    struct lock alloc_lock;    /* Serializes filling holes in the data. */
+    unsigned map_seq;          /* Changes to the sector map, odd while
+                                  one is being made. */
+    struct inode_disk data;    /* Cached on-disk inode. */
+    bool data_dirty;           /* True if data differs from disk. */
+    uint32_t delayed_start;    /* First file sector not yet allocated. */
+    uint32_t delayed_cnt;      /* Number of such sectors. */
+    void *delayed[INODE_DELAYED_MAX]; /* Their pinned cache blocks. */
   };
 
 struct bitmap;
 
 void inode_init (void);
+void inode_set_extents (bool);
+void inode_adopt_layout (block_sector_t);
 bool inode_create (block_sector_t, uint32_t, bool);
+bool inode_allocate (struct inode *);
 struct inode *inode_open (block_sector_t);
 struct inode *inode_reopen (struct inode *);
 block_sector_t inode_get_inumber (const struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
 uint32_t inode_read_at (struct inode *, void *, uint32_t size, uint32_t offset);
+void inode_readahead (struct inode *, uint32_t offset, uint32_t size);
 uint32_t inode_write_at (struct inode *, const void *, uint32_t size, uint32_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 uint32_t inode_length (const struct inode *);
+uint32_t inode_fragment_cnt (struct inode *);
+void inode_flush_all (void);
 
 #endif /* filesys/inode.h */
\ No newline at end of file
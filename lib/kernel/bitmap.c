@@ -288,6 +288,43 @@ bitmap_all (const struct bitmap *b, size_t start, size_t cnt)
 
 /* Finding set or unset bits. */
 
+/* Returns the index of the first bit in B at or after START, and
+   before END, that is set to VALUE, or END if there is none.
+   Elements without such a bit are skipped with a single compare,
+   and the bit is located within its element by a bit scan. */
+static size_t
+next_bit (const struct bitmap *b, size_t start, size_t end, bool value)
+{
+  elem_type skip = value ? 0 : (elem_type) -1;
+  size_t idx = elem_idx (start);
+  elem_type bits;
+
+  if (start >= end)
+    return end;
+
+  /* Bits before START in its element do not count. */
+  bits = (b->bits[idx] ^ skip) & ((elem_type) -1 << (start % ELEM_BITS));
+  while (bits == 0)
+    {
+      if (++idx * ELEM_BITS >= end)
+        return end;
+      bits = b->bits[idx] ^ skip;
+    }
+  start = idx * ELEM_BITS + __builtin_ctzl (bits);
+  return start < end ? start : end;
+}
+
+/* Returns the index of the first bit in B at or after START, and
+   before END, that is set to VALUE, or END if there is none. */
+size_t
+bitmap_next (const struct bitmap *b, size_t start, size_t end, bool value)
+{
+  ASSERT (b != NULL);
+  ASSERT (end <= b->bit_cnt);
+
+  return next_bit (b, start, end, value);
+}
+
 /* Finds and returns the starting index of the first group of CNT
    consecutive bits in B at or after START that are all set to
    VALUE.
@@ -298,13 +335,22 @@ bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
 
+  if (cnt == 0)
+    return start;
   if (cnt <= b->bit_cnt) 
     {
       size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i; 
+      size_t i = start;
+
+      /* Jump from each run of VALUE bits to the bit that ends it,
+         instead of testing every starting bit. */
+      while ((i = next_bit (b, i, b->bit_cnt, value)) <= last)
+        {
+          size_t end = next_bit (b, i, i + cnt, !value);
+          if (end == i + cnt)
+            return i;
+          i = end;
+        }
     }
   return BITMAP_ERROR;
 }
@@ -358,6 +404,22 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes the SIZE bytes of B that start at byte offset OFS in
+   B's file representation to the same place in FILE, stopping at
+   the end of B.  Returns true if successful, false otherwise. */
+bool
+bitmap_write_part (const struct bitmap *b, struct file *file,
+                   size_t ofs, size_t size)
+{
+  size_t file_size = byte_cnt (b->bit_cnt);
+  if (ofs >= file_size)
+    return true;
+  if (size > file_size - ofs)
+    size = file_size - ofs;
+  return file_write_at (file, (const uint8_t *) b->bits + ofs, size, ofs)
+         == (off_t) size;
+}
 #endif /* FILESYS */
 
 /* Debugging. */
@@ -26,6 +26,7 @@ enum
     SYS_GET_BLOCK_READ_CNT,     /* Get the read count of BLOCK. */
     SYS_GET_BLOCK_WRITE_CNT,    /* Get the write count of BLOCK. */
     SYS_BUFFER_CLEAR,           /* Reset the buffer cache. */
+    SYS_GET_FRAGMENT_CNT,       /* Count the disk runs of a file. */
 
     /* Project 4 only. */
     SYS_CHDIR,                  /* Change the current directory. */
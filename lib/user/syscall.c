@@ -206,3 +206,9 @@ buffer_clear (void)
 {
   syscall0 (SYS_BUFFER_CLEAR);
 }
+
+int
+get_fragment_cnt (int fd) 
+{
+  return syscall1 (SYS_GET_FRAGMENT_CNT, fd);
+}
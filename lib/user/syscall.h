@@ -48,5 +48,6 @@ int inumber (int fd);
 unsigned long long get_block_write_cnt (void);
 unsigned long long get_block_read_cnt (void);
 void buffer_clear (void);
+int get_fragment_cnt (int fd);
 
 #endif /* lib/user/syscall.h */
@@ -0,0 +1,96 @@
+/* Checks that the buffer cache resists a large sequential scan.
+   A small set of files is read twice, so that their inodes,
+   directory blocks and data count as frequently used.  Then a
+   child process reads a file several times the size of the
+   cache sequentially while we keep reading the small set.  Once
+   the scan is over, reading the small set again should cost
+   almost no disk reads. */
+
+#include <random.h>
+#include <stdio.h>
+#include <syscall.h>
+#include "tests/filesys/extended/cache-scan.h"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define HOT_CNT 8
+#define HOT_PASSES 16
+
+static char buf[512];
+
+/* Opens each file of the small set and reads its only block. */
+static void
+read_hot_set (void) 
+{
+  char name[16];
+  int i;
+
+  for (i = 0; i < HOT_CNT; i++) 
+    {
+      int fd;
+
+      snprintf (name, sizeof name, "hot%d", i);
+      CHECK ((fd = open (name)) > 1, "open \"%s\"", name);
+      CHECK (read (fd, buf, sizeof buf) == (int) sizeof buf,
+             "read \"%s\"", name);
+      close (fd);
+    }
+}
+
+void
+test_main (void) 
+{
+  char name[16];
+  size_t ofs;
+  pid_t child;
+  int fd;
+  int i;
+
+  random_bytes (buf, sizeof buf);
+
+  CHECK (create (scan_file_name, 0), "create \"%s\"", scan_file_name);
+  CHECK ((fd = open (scan_file_name)) > 1, "open \"%s\"", scan_file_name);
+  quiet = true;
+  for (ofs = 0; ofs < SCAN_SIZE; ofs += sizeof buf)
+    CHECK (write (fd, buf, sizeof buf) == (int) sizeof buf,
+           "write %zu bytes at offset %zu in \"%s\"",
+           sizeof buf, ofs, scan_file_name);
+  quiet = false;
+  msg ("close \"%s\"", scan_file_name);
+  close (fd);
+
+  quiet = true;
+  for (i = 0; i < HOT_CNT; i++) 
+    {
+      snprintf (name, sizeof name, "hot%d", i);
+      CHECK (create (name, sizeof buf), "create \"%s\"", name);
+    }
+  quiet = false;
+  msg ("create small files");
+
+  buffer_clear ();
+  msg ("reset cache");
+
+  quiet = true;
+  read_hot_set ();
+  read_hot_set ();
+  quiet = false;
+  msg ("warm small files");
+
+  CHECK ((child = exec ("child-scan")) != -1, "exec child-scan");
+  quiet = true;
+  for (i = 0; i < HOT_PASSES; i++)
+    read_hot_set ();
+  quiet = false;
+  msg ("read small files during scan");
+  CHECK (wait (child) == 0, "wait for child-scan");
+
+  unsigned long long read_cnt_before = get_block_read_cnt ();
+  quiet = true;
+  read_hot_set ();
+  quiet = false;
+  unsigned long long read_cnt_after = get_block_read_cnt ();
+
+  CHECK (read_cnt_after - read_cnt_before < HOT_CNT / 2,
+         "small files still cached after scan");
+}
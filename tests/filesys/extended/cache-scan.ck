@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(cache-scan) begin
+(cache-scan) create "scanfile"
+(cache-scan) open "scanfile"
+(cache-scan) close "scanfile"
+(cache-scan) create small files
+(cache-scan) reset cache
+(cache-scan) warm small files
+(cache-scan) exec child-scan
+(cache-scan) read small files during scan
+(cache-scan) wait for child-scan
+(cache-scan) small files still cached after scan
+(cache-scan) end
+EOF
+pass;
@@ -0,0 +1,8 @@
+#ifndef TESTS_FILESYS_EXTENDED_CACHE_SCAN_H
+#define TESTS_FILESYS_EXTENDED_CACHE_SCAN_H
+
+/* Several times the 64-block buffer cache. */
+#define SCAN_SIZE (256 * 512)
+static const char scan_file_name[] = "scanfile";
+
+#endif /* tests/filesys/extended/cache-scan.h */
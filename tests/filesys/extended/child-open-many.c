@@ -0,0 +1,60 @@
+/* Child process for open-many.
+   Creates FILE_CNT files in a directory of its own, opens every
+   one of them OPEN_PASSES times while keeping the first opens,
+   then closes and removes them all. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include "tests/filesys/extended/open-many.h"
+#include "tests/lib.h"
+
+const char *test_name = "child-open-many";
+
+static int fds[FILE_CNT];
+
+int
+main (int argc, const char *argv[]) 
+{
+  char dir_name[16], file_name[32];
+  int child_idx;
+  int pass, i;
+
+  quiet = true;
+
+  CHECK (argc == 2, "argc must be 2, actually %d", argc);
+  child_idx = atoi (argv[1]);
+
+  snprintf (dir_name, sizeof dir_name, "d%d", child_idx);
+  CHECK (mkdir (dir_name), "mkdir \"%s\"", dir_name);
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      snprintf (file_name, sizeof file_name, "%s/f%d", dir_name, i);
+      CHECK (create (file_name, 0), "create \"%s\"", file_name);
+    }
+
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      snprintf (file_name, sizeof file_name, "%s/f%d", dir_name, i);
+      CHECK ((fds[i] = open (file_name)) > 1, "open \"%s\"", file_name);
+    }
+  for (pass = 1; pass < OPEN_PASSES; pass++)
+    for (i = 0; i < FILE_CNT; i++) 
+      {
+        int fd;
+
+        snprintf (file_name, sizeof file_name, "%s/f%d", dir_name, i);
+        CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+        close (fd);
+      }
+
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      snprintf (file_name, sizeof file_name, "%s/f%d", dir_name, i);
+      close (fds[i]);
+      CHECK (remove (file_name), "remove \"%s\"", file_name);
+    }
+  CHECK (remove (dir_name), "remove \"%s\"", dir_name);
+
+  return child_idx;
+}
@@ -0,0 +1,29 @@
+/* Child process for cache-scan.
+   Reads the whole scan file sequentially, one block at a time. */
+
+#include <syscall.h>
+#include "tests/filesys/extended/cache-scan.h"
+#include "tests/lib.h"
+
+const char *test_name = "child-scan";
+
+static char buf[512];
+
+int
+main (void) 
+{
+  size_t ofs = 0;
+  int bytes_read;
+  int fd;
+
+  quiet = true;
+
+  CHECK ((fd = open (scan_file_name)) > 1, "open \"%s\"", scan_file_name);
+  while ((bytes_read = read (fd, buf, sizeof buf)) > 0)
+    ofs += bytes_read;
+  CHECK (ofs == SCAN_SIZE, "read %zu bytes of \"%s\", expected %d",
+         ofs, scan_file_name, SCAN_SIZE);
+  close (fd);
+
+  return 0;
+}
@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($a) = random_bytes (32768);
+my ($b) = random_bytes (32768);
+check_archive ({"a" => [$a], "b" => [$b]});
+pass;
@@ -0,0 +1,67 @@
+/* Appends to two files a sector at a time, alternating between
+   them, and checks that each file still ends up in a few runs of
+   contiguous disk sectors instead of one per sector. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SECTOR_CNT 64
+#define FILE_SIZE (SECTOR_CNT * 512)
+
+/* Most runs a file may be stored in.  Allocating each sector as
+   it is written would give SECTOR_CNT. */
+#define MAX_FRAGMENTS (SECTOR_CNT / 4)
+
+static char buf_a[FILE_SIZE];
+static char buf_b[FILE_SIZE];
+
+static void
+check_fragments (const char *file_name, int fd) 
+{
+  int cnt = get_fragment_cnt (fd);
+  if (cnt < 1 || cnt > MAX_FRAGMENTS)
+    fail ("\"%s\" is stored in %d runs of sectors, expected at most %d",
+          file_name, cnt, MAX_FRAGMENTS);
+  msg ("\"%s\" is stored in at most %d runs of sectors",
+       file_name, MAX_FRAGMENTS);
+}
+
+void
+test_main (void) 
+{
+  int fd_a, fd_b;
+  size_t ofs;
+
+  random_init (0);
+  random_bytes (buf_a, sizeof buf_a);
+  random_bytes (buf_b, sizeof buf_b);
+
+  CHECK (create ("a", 0), "create \"a\"");
+  CHECK (create ("b", 0), "create \"b\"");
+
+  CHECK ((fd_a = open ("a")) > 1, "open \"a\"");
+  CHECK ((fd_b = open ("b")) > 1, "open \"b\"");
+
+  msg ("append to \"a\" and \"b\" alternately");
+  for (ofs = 0; ofs < FILE_SIZE; ofs += 512) 
+    {
+      if (write (fd_a, buf_a + ofs, 512) != 512)
+        fail ("write 512 bytes at offset %zu in \"a\" failed", ofs);
+      if (write (fd_b, buf_b + ofs, 512) != 512)
+        fail ("write 512 bytes at offset %zu in \"b\" failed", ofs);
+    }
+
+  check_fragments ("a", fd_a);
+  check_fragments ("b", fd_b);
+
+  msg ("close \"a\"");
+  close (fd_a);
+
+  msg ("close \"b\"");
+  close (fd_b);
+
+  check_file ("a", buf_a, FILE_SIZE);
+  check_file ("b", buf_b, FILE_SIZE);
+}
@@ -0,0 +1,25 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(frag-interleave) begin
+(frag-interleave) create "a"
+(frag-interleave) create "b"
+(frag-interleave) open "a"
+(frag-interleave) open "b"
+(frag-interleave) append to "a" and "b" alternately
+(frag-interleave) "a" is stored in at most 16 runs of sectors
+(frag-interleave) "b" is stored in at most 16 runs of sectors
+(frag-interleave) close "a"
+(frag-interleave) close "b"
+(frag-interleave) open "a" for verification
+(frag-interleave) verified contents of "a"
+(frag-interleave) close "a"
+(frag-interleave) open "b" for verification
+(frag-interleave) verified contents of "b"
+(frag-interleave) close "b"
+(frag-interleave) end
+EOF
+pass;
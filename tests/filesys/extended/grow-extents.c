@@ -0,0 +1,6 @@
+/* Grows a file from 0 bytes to 204,800 bytes, 1,234 bytes at a
+   time, on a file system formatted with extent-based inodes.
+   The file outgrows the direct blocks of the indexed layout. */
+
+#define TEST_SIZE 204800
+#include "tests/filesys/extended/grow-seq.inc"
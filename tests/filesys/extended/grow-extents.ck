@@ -0,0 +1,17 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-extents) begin
+(grow-extents) create "testme"
+(grow-extents) open "testme"
+(grow-extents) writing "testme"
+(grow-extents) close "testme"
+(grow-extents) open "testme" for verification
+(grow-extents) verified contents of "testme"
+(grow-extents) close "testme"
+(grow-extents) end
+EOF
+pass;
@@ -0,0 +1,6 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_archive ({"child-open-many" => "tests/filesys/extended/child-open-many"});
+pass;
@@ -0,0 +1,22 @@
+/* Has several processes each create a directory of files, open
+   them all, keep them open while opening them again several
+   times, then close and remove them.  Thousands of distinct
+   inodes are open at once, so this measures how well the table
+   of open inodes copes with many entries and concurrent
+   openers. */
+
+#include <syscall.h>
+#include "tests/filesys/extended/open-many.h"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define CHILD_CNT 4
+
+void
+test_main (void) 
+{
+  pid_t children[CHILD_CNT];
+
+  exec_children ("child-open-many", children, CHILD_CNT);
+  wait_children (children, CHILD_CNT);
+}
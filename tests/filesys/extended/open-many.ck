@@ -0,0 +1,17 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(open-many) begin
+(open-many) exec child 1 of 4: "child-open-many 0"
+(open-many) exec child 2 of 4: "child-open-many 1"
+(open-many) exec child 3 of 4: "child-open-many 2"
+(open-many) exec child 4 of 4: "child-open-many 3"
+(open-many) wait for child 1 of 4 returned 0 (expected 0)
+(open-many) wait for child 2 of 4 returned 1 (expected 1)
+(open-many) wait for child 3 of 4 returned 2 (expected 2)
+(open-many) wait for child 4 of 4 returned 3 (expected 3)
+(open-many) end
+EOF
+pass;
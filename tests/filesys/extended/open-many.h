@@ -0,0 +1,10 @@
+#ifndef TESTS_FILESYS_EXTENDED_OPEN_MANY_H
+#define TESTS_FILESYS_EXTENDED_OPEN_MANY_H
+
+/* Files each child creates and holds open at once. */
+#define FILE_CNT 256
+
+/* Times each child opens its whole set of files. */
+#define OPEN_PASSES 4
+
+#endif /* tests/filesys/extended/open-many.h */
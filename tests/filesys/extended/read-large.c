@@ -0,0 +1,33 @@
+/* Writes a 256 kB file with a single write() and reads it back
+   with a single read(), each far larger than the kernel could
+   buffer in one allocation. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define TEST_SIZE (256 * 1024)
+
+static char buf[TEST_SIZE];
+static char buf2[TEST_SIZE];
+
+void
+test_main (void) 
+{
+  const char *file_name = "large";
+  int fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, sizeof buf) == TEST_SIZE,
+         "write %d bytes to \"%s\" at once", TEST_SIZE, file_name);
+  msg ("seek \"%s\" to 0", file_name);
+  seek (fd, 0);
+  CHECK (read (fd, buf2, sizeof buf2) == TEST_SIZE,
+         "read %d bytes from \"%s\" at once", TEST_SIZE, file_name);
+  compare_bytes (buf2, buf, sizeof buf, 0, file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
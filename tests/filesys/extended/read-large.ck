@@ -0,0 +1,15 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(read-large) begin
+(read-large) create "large"
+(read-large) open "large"
+(read-large) write 262144 bytes to "large" at once
+(read-large) seek "large" to 0
+(read-large) read 262144 bytes from "large" at once
+(read-large) close "large"
+(read-large) end
+EOF
+pass;
@@ -0,0 +1,163 @@
+/* Test program for lib/kernel/bitmap.c.
+
+   Checks bitmap_scan() against the straightforward scan it
+   replaced, which tests every starting bit with
+   bitmap_contains(), and compares the time both take to find
+   runs of free bits in a large, fragmented map.
+
+   Unlike the other tests here, this one runs on the host: "make"
+   in this directory builds it with lib/kernel/bitmap.c, and
+   "./bitmap" runs it.
+
+   This is not a test we will run on your submitted projects.
+   It is here for completeness.
+*/
+
+#undef NDEBUG
+#include <bitmap.h>
+#include <debug.h>
+#include <random.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Number of bits in the benchmark map. */
+#define BIT_CNT (1024 * 1024)
+
+/* Sizes of the runs searched for. */
+static const size_t run_sizes[] = {1, 4, 16, 64};
+#define RUN_SIZE_CNT (sizeof run_sizes / sizeof *run_sizes)
+
+/* Number of scans per run size, from evenly spaced starts. */
+#define SCAN_CNT 16
+
+static size_t reference_scan (const struct bitmap *, size_t start,
+                              size_t cnt, bool value);
+static void fragment (struct bitmap *);
+static void verify_small_maps (void);
+
+/* Test and time the bitmap scan. */
+int
+main (void)
+{
+  struct bitmap *b;
+  size_t i, j;
+
+  verify_small_maps ();
+
+  b = bitmap_create (BIT_CNT);
+  ASSERT (b != NULL);
+  fragment (b);
+
+  for (i = 0; i < RUN_SIZE_CNT; i++)
+    {
+      size_t cnt = run_sizes[i];
+      clock_t start;
+      double fast_ms, reference_ms;
+      size_t fast[SCAN_CNT];
+
+      start = clock ();
+      for (j = 0; j < SCAN_CNT; j++)
+        fast[j] = bitmap_scan (b, j * (BIT_CNT / SCAN_CNT), cnt, false);
+      fast_ms = (clock () - start) * 1000.0 / CLOCKS_PER_SEC;
+
+      start = clock ();
+      for (j = 0; j < SCAN_CNT; j++)
+        ASSERT (fast[j] == reference_scan (b, j * (BIT_CNT / SCAN_CNT),
+                                           cnt, false));
+      reference_ms = (clock () - start) * 1000.0 / CLOCKS_PER_SEC;
+
+      printf ("runs of %zu free bits: %.3f ms, reference %.3f ms\n",
+              cnt, fast_ms, reference_ms);
+    }
+
+  bitmap_destroy (b);
+  printf ("done\n");
+  return 0;
+}
+
+/* The scan bitmap_scan() used before it skipped whole elements:
+   tries every starting bit in turn. */
+static size_t
+reference_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  if (cnt <= bitmap_size (b))
+    {
+      size_t last = bitmap_size (b) - cnt;
+      size_t i;
+      for (i = start; i <= last; i++)
+        if (!bitmap_contains (b, i, cnt, !value))
+          return i;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Marks about seven in eight bits of B used, leaving short free
+   runs scattered over it, like a long-used free map. */
+static void
+fragment (struct bitmap *b)
+{
+  size_t i;
+
+  random_init (0);
+  for (i = 0; i < bitmap_size (b); i++)
+    bitmap_set (b, i, random_ulong () % 8 != 0);
+}
+
+/* Compares bitmap_scan() with reference_scan() on many small maps
+   of different densities, for every start and run size. */
+static void
+verify_small_maps (void)
+{
+  size_t bit_cnt;
+
+  printf ("verifying small maps:");
+  for (bit_cnt = 0; bit_cnt < 100; bit_cnt += 7)
+    {
+      struct bitmap *b = bitmap_create (bit_cnt);
+      int density;
+
+      ASSERT (b != NULL);
+      printf (" %zu", bit_cnt);
+      for (density = 0; density <= 8; density++)
+        {
+          size_t i, start, cnt;
+
+          for (i = 0; i < bit_cnt; i++)
+            bitmap_set (b, i, random_ulong () % 8 < (unsigned) density);
+          for (start = 0; start <= bit_cnt; start++)
+            for (cnt = 0; cnt <= bit_cnt + 1; cnt++)
+              {
+                ASSERT (bitmap_scan (b, start, cnt, false)
+                        == reference_scan (b, start, cnt, false));
+                ASSERT (bitmap_scan (b, start, cnt, true)
+                        == reference_scan (b, start, cnt, true));
+              }
+        }
+      bitmap_destroy (b);
+    }
+  printf ("\n");
+}
+
+/* Stands in for the kernel's debug_panic(), which ASSERT calls. */
+void
+debug_panic (const char *file, int line, const char *function,
+             const char *message, ...)
+{
+  va_list args;
+
+  printf ("%s:%d: %s(): ", file, line, function);
+  va_start (args, message);
+  vprintf (message, args);
+  va_end (args);
+  printf ("\n");
+  abort ();
+}
+
+/* Stands in for the kernel's hex_dump(), which bitmap_dump() calls. */
+void
+hex_dump (uintptr_t ofs UNUSED, const void *buf UNUSED, size_t size UNUSED,
+          bool ascii UNUSED)
+{
+}
@@ -0,0 +1,26 @@
+/* Included ahead of lib/kernel/bitmap.c when tests/internal/Makefile
+   compiles it for the host.  The host's headers are found before
+   Pintos's, so they are all pulled in here first. */
+
+#ifndef TESTS_INTERNAL_HOST_BITMAP_H
+#define TESTS_INTERNAL_HOST_BITMAP_H
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* In lib/stdio.h, which the host's <stdio.h> hides. */
+void hex_dump (uintptr_t ofs, const void *, size_t size, bool ascii);
+
+/* bitmap.c's elem_type is an unsigned long, 32 bits wide in the
+   kernel, and bitmap_mark() and friends operate on it with 32-bit
+   "orl", "andl" and "xorl".  Keep it 32 bits wide on a 64-bit host
+   too, so that they assemble and the scan works on the kernel's word
+   size. */
+#define long int
+
+#endif /* tests/internal/host-bitmap.h */
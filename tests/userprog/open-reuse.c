@@ -0,0 +1,43 @@
+/* Opens a file many times at once, closes every other descriptor,
+   and opens it again, which must hand back the lowest free
+   descriptors first, filling the holes in order. */
+
+#include <syscall.h>
+#include "tests/userprog/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FD_CNT 1000
+
+static int fds[FD_CNT];
+
+void
+test_main (void) 
+{
+  int i;
+
+  msg ("open \"sample.txt\" %d times", FD_CNT);
+  for (i = 0; i < FD_CNT; i++)
+    {
+      fds[i] = open ("sample.txt");
+      if (fds[i] < 2)
+        fail ("open #%d returned %d", i, fds[i]);
+      if (i > 0 && fds[i] != fds[i - 1] + 1)
+        fail ("open #%d returned %d after %d", i, fds[i], fds[i - 1]);
+    }
+
+  msg ("close every other descriptor");
+  for (i = 1; i < FD_CNT; i += 2)
+    close (fds[i]);
+
+  msg ("open \"sample.txt\" %d more times", FD_CNT / 2);
+  for (i = 1; i < FD_CNT; i += 2)
+    {
+      int fd = open ("sample.txt");
+      if (fd != fds[i])
+        fail ("reopen returned %d instead of %d", fd, fds[i]);
+    }
+
+  CHECK (filesize (fds[FD_CNT - 1]) == sizeof sample - 1,
+         "filesize of last descriptor");
+}
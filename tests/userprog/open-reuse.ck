@@ -0,0 +1,14 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(open-reuse) begin
+(open-reuse) open "sample.txt" 1000 times
+(open-reuse) close every other descriptor
+(open-reuse) open "sample.txt" 500 more times
+(open-reuse) filesize of last descriptor
+(open-reuse) end
+open-reuse: exit(0)
+EOF
+pass;
@@ -34,9 +34,12 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "devices/ramdisk.h"
+#include "devices/virtio-blk.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #include "filesys/directory.h"
+#include "filesys/cache.h"
 #endif
 
 /* Page directory with kernel mappings only. */
@@ -46,6 +49,9 @@ uint32_t *init_page_dir;
 /* -f: Format the file system? */
 static bool format_filesys;
 
+/* -extents: Format with extent-based inodes? */
+static bool format_extents;
+
 /* -filesys, -scratch, -swap: Names of block devices to use,
    overriding the defaults. */
 static const char *filesys_bdev_name;
@@ -123,9 +129,11 @@ main (void)
 
 #ifdef FILESYS
   /* Initialize file system. */
+  ramdisk_init ();
   ide_init ();
+  virtio_blk_init ();
   locate_block_devices ();
-  filesys_init (format_filesys);
+  filesys_init (format_filesys, format_extents);
   thread_current ()->cwd = dir_open_root ();
 #endif
 
@@ -245,10 +253,29 @@ parse_options (char **argv)
 #ifdef FILESYS
       else if (!strcmp (name, "-f"))
         format_filesys = true;
+      else if (!strcmp (name, "-extents"))
+        format_extents = true;
       else if (!strcmp (name, "-filesys"))
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-ide-dma"))
+        ide_dma = true;
+      else if (!strcmp (name, "-ramdisk"))
+        {
+          if (value == NULL || !ramdisk_configure (value))
+            PANIC ("bad RAM disk `%s' (use -h for help)", value);
+        }
+      else if (!strcmp (name, "-iosched"))
+        {
+          if (value == NULL || !block_select_elevator (value))
+            PANIC ("bad I/O scheduler choice `%s' (use -h for help)", value);
+        }
+      else if (!strcmp (name, "-cache"))
+        {
+          if (value == NULL || !buffer_select_policy (value))
+            PANIC ("unknown cache policy `%s' (use -h for help)", value);
+        }
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -373,8 +400,18 @@ usage (void)
           "  -r                 Reboot after actions.\n"
 #ifdef FILESYS
           "  -f                 Format file system device during startup.\n"
+          "  -extents           With -f, map file data with extents.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -ide-dma           Transfer IDE disk data by bus master DMA.\n"
+          "  -ramdisk=ROLE:KB   Add a KB kB RAM disk ram0 for ROLE\n"
+          "                     (filesys, scratch, swap), taken from user\n"
+          "                     memory first.  Leave room with pintos -m:\n"
+          "                     e.g. 2048 kB needs -m 8.\n"
+          "  -iosched=DEV:SCHED Schedule DEV's requests with SCHED\n"
+          "                     (deadline, clook, fifo).  A partition's\n"
+          "                     requests are scheduled by its disk.\n"
+          "  -cache=POLICY      Use POLICY (car, clock) for buffer cache replacement.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
@@ -8,15 +8,14 @@
 #include "threads/synch.h"
 #include "threads/fixed-point.h"
 
+/* A slot in a process's file descriptor table. */
 struct fd
   {
-    int fd;                 /* File descriptor of this opened file. */
     bool is_dir;            /* Whether file or directory */
     union {
-      struct file *file;    /* Pointer to struct file or dir */
-      struct dir *dir;
+      struct file *file;    /* Pointer to struct file or dir, */
+      struct dir *dir;      /* or null if the slot is free. */
     };
-    struct list_elem elem;  /* List element for the list open_files in struct wait_status. */
   };
 
 /* States in a thread's life cycle. */
@@ -123,10 +122,10 @@ struct thread
 #ifdef USERPROG
     struct wait_status *wait_status;    /* This process’s completion state.*/
     struct list wait_status_list;       /* Completion status of children. */  
-    int next_fd;                        /* The next file descriptor can be assigned.
-                                           next_fd = max of current file descriptors + 1. */            
-    struct list open_files;             /* A list of struct fd, representing 
-                                           currently opened files */
+    struct fd *fds;                     /* Open files, indexed by file
+                                           descriptor. */
+    int fd_cnt;                         /* Number of slots in fds. */
+    int fd_hint;                        /* No free slot below this one. */
     struct file *exe;                   /* The process's own executable file. */
 
     /* Owned by userprog/process.c. */
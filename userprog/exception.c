@@ -5,6 +5,7 @@
 #include "threads/interrupt.h"
 #include "threads/thread.h"
 #include "userprog/syscall.h"
+#include "userprog/uaccess.h"
 
 /* Number of page faults processed. */
 static long long page_fault_cnt;
@@ -152,11 +153,16 @@ page_fault (struct intr_frame *f)
   /* To implement virtual memory, delete the rest of the function
      body, and replace it with code that brings in the page to
      which fault_addr refers. */
-  if (user) {
+  if (user)
     kill (f);
-  } else {
-    f->eip = (void (*) (void))f->eax;
-    f->eax = (uint32_t)0xffffffff;
-    return;
-  }
+  else if (!uaccess_fixup (f))
+    {
+      /* A kernel fault outside the user access functions is a
+         kernel bug. */
+      printf ("Page fault at %p: %s error %s page in kernel context.\n",
+              fault_addr,
+              not_present ? "not present" : "rights violation",
+              write ? "writing" : "reading");
+      kill (f);
+    }
 }
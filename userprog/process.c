@@ -51,8 +51,9 @@ process_execute (const char *file_name)
   } 
 
   struct thread *t = get_thread (tid);
-  t->next_fd = 2;          
-  list_init (&(t->open_files)); 
+  t->fds = NULL;
+  t->fd_cnt = 0;
+  t->fd_hint = 2;
   struct wait_status *ws = malloc (sizeof (struct wait_status));
   sema_init (&(ws->wait_exec), 0);
   sema_init (&(ws->parent_wait), 0);
@@ -6,6 +6,7 @@
 #include "threads/thread.h"
 #include "threads/vaddr.h"
 #include "threads/malloc.h"
+#include "userprog/uaccess.h"
 #include "lib/syscall-nr.h"
 #include "user/syscall.h"
 #include "devices/shutdown.h"
@@ -17,11 +18,7 @@
 
 static void syscall_handler (struct intr_frame *);
 
-static bool put_user (uint8_t *udst, uint8_t byte);
 static int get_argc (int syscall_num);
-static int get_user (const uint8_t *uaddr);
-static bool usermem_read (uint8_t *udst, int size_byte);
-static bool usermem_write (uint8_t *udst, uint8_t *src, int size_byte);
 
 static void syscall_halt (void);
 void syscall_exit (int status);
@@ -47,6 +44,7 @@ static int syscall_inumber (int fd);
 static unsigned long long syscall_get_block_read_cnt (void);
 static unsigned long long syscall_get_block_write_cnt (void);
 static void syscall_buffer_clear (void);
+static int syscall_get_fragment_cnt (int fd);
 
 void
 syscall_init (void) 
@@ -54,80 +52,6 @@ syscall_init (void)
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
 }
 
-/* Reads a byte at user virtual address UADDR.
-   UADDR must be below PHYS_BASE.
-   Returns the byte value if successful, -1 if a segfault
-   occurred. */
-static int
-get_user (const uint8_t *uaddr)
-{
-  int result;
-  asm ("movl $1f, %0; movzbl %1, %0; 1:"
-    : "=&a" (result) : "m" (*uaddr));
-  return result;
-}
-
-/* Writes BYTE to user address UDST.
-   UDST must be below PHYS_BASE.
-   Returns true if successful, false if a segfault occurred. */
-static bool
-put_user (uint8_t *udst, uint8_t byte)
-{
-  int error_code;
-  asm ("movl $1f, %0; movb %b2, %1; 1:"
-    : "=&a" (error_code), "=m" (*udst) : "q" (byte));
-  return error_code != -1;
-}
-
-/* Helper function read for all system calls. */
-static bool
-usermem_read (uint8_t *udst, int size_byte)
-{
-  int i = 0;
-  if (!udst)
-    return false;
-  if (size_byte == -1) {
-    int temp;
-    do {
-      if ((udst + i) >= (uint8_t*) PHYS_BASE) {
-        return false;
-      } else {
-        if ((temp = get_user (udst + i)) == -1) {
-          return false;
-        }
-      }
-      i++;
-    } while (temp);
-    return true;
-  } else {
-    for (i = 0; i < size_byte; ++i) {
-      if ((udst + i) >= (uint8_t*) PHYS_BASE) {
-        return false;
-      } else {
-        if (get_user (udst + i) == -1) {
-          return false;
-        }
-      }
-    }
-    return true;
-  }
-}
-
-static bool 
-usermem_write (uint8_t *udst, uint8_t *src, int size_byte) 
-{
-  int i = 0;
-  if ((udst + size_byte) >= (uint8_t*) PHYS_BASE) {
-    return false;
-  }
-  for (i = 0; i < size_byte; ++i) {
-    if (put_user((udst + i), *(src + i)) == false) {
-      return false;
-    }
-  }
-  return true;
-}
-
 static int 
 get_argc (int syscall_num)
 {
@@ -142,7 +66,8 @@ get_argc (int syscall_num)
     case SYS_FILESIZE: case SYS_TELL:
     case SYS_CLOSE: case SYS_CHDIR:
     case SYS_MKDIR: case SYS_ISDIR:
-    case SYS_INUMBER:                  return 1;
+    case SYS_INUMBER:
+    case SYS_GET_FRAGMENT_CNT:         return 1;
 
     case SYS_CREATE: case SYS_SEEK:
     case SYS_READDIR:                  return 2;
@@ -154,9 +79,9 @@ get_argc (int syscall_num)
 static void
 syscall_handler (struct intr_frame *f) 
 {
-  uint32_t* args = ((uint32_t*) f->esp);
+  uint32_t args[4];
   int syscall_num;
-  if (!usermem_read ((uint8_t*) args, 4)) {
+  if (!copy_from_user (args, f->esp, sizeof *args)) {
     syscall_exit (-1);
   }
   syscall_num = *args;
@@ -164,11 +89,9 @@ syscall_handler (struct intr_frame *f)
   if (argc == -1) {
     syscall_exit (-1);
   } else {
-    int i;
-    for (i = 0; i < argc; ++i) {
-      if (!usermem_read ((uint8_t*) args + 4 * (i + 1), 4)) {
-        syscall_exit (-1);
-      }
+    if (!copy_from_user (args + 1, (uint32_t *) f->esp + 1,
+                         argc * sizeof *args)) {
+      syscall_exit (-1);
     }
     switch(syscall_num) {
       case SYS_HALT:
@@ -242,6 +165,9 @@ syscall_handler (struct intr_frame *f)
       case SYS_BUFFER_CLEAR:
         syscall_buffer_clear ();
         break;
+      case SYS_GET_FRAGMENT_CNT:
+        f->eax = (uint32_t) syscall_get_fragment_cnt ((int) *(args + 1));
+        break;
       default: syscall_exit (-1);
     }
   }
@@ -283,17 +209,18 @@ syscall_exit (int status)
     }
   }
 
-  e = list_begin (&(cur->open_files));
-  while (e != list_end (&(cur->open_files))) {
-    struct fd *f = list_entry (e, struct fd, elem);
-    e = list_next (e);
-    if (f->is_dir) {
+  int fd;
+  for (fd = 0; fd < cur->fd_cnt; fd++) {
+    struct fd *f = &cur->fds[fd];
+    if (f->file == NULL) {
+      continue;
+    } else if (f->is_dir) {
       dir_close (f->dir);
     } else {
       file_close (f->file);
     }
-    free (f);
   }
+  free (cur->fds);
 
   sema_up(&(ws->parent_wait));
   char name[16];
@@ -311,7 +238,7 @@ syscall_exit (int status)
 static pid_t 
 syscall_exec (const char *file)
 {
-  if (!usermem_read ((uint8_t *)file, -1)) {
+  if (strlen_user (file) < 0) {
     syscall_exit (-1);
   }
   return process_execute (file);
@@ -326,7 +253,7 @@ syscall_wait (pid_t pid)
 static bool 
 syscall_create (const char *file, unsigned initial_size)
 {
-  if (!usermem_read ((uint8_t *)file, -1)) {
+  if (strlen_user (file) < 0) {
     syscall_exit (-1);
   }
   bool result = filesys_create (file, initial_size);
@@ -336,52 +263,86 @@ syscall_create (const char *file, unsigned initial_size)
 static bool 
 syscall_remove (const char *file)
 {
-  if (!usermem_read ((uint8_t *)file, -1)) {
+  if (strlen_user (file) < 0) {
     syscall_exit (-1);
   }
   bool result = filesys_remove (file);
   return result;
 }
 
+/* Returns the lowest free file descriptor of the current process,
+   growing its table if every slot is taken, or -1 if out of
+   memory.  Slots below fd_hint are known to be taken, so the
+   search starts there. */
+static int
+alloc_fd (void)
+{
+  struct thread *cur = thread_current ();
+  int fd;
+  for (fd = cur->fd_hint; fd < cur->fd_cnt; fd++) {
+    if (cur->fds[fd].file == NULL) {
+      break;
+    }
+  }
+  if (fd == cur->fd_cnt) {
+    int cnt = cur->fd_cnt == 0 ? 16 : cur->fd_cnt * 2;
+    struct fd *fds = realloc (cur->fds, cnt * sizeof *fds);
+    if (fds == NULL) {
+      return -1;
+    }
+    memset (fds + cur->fd_cnt, 0, (cnt - cur->fd_cnt) * sizeof *fds);
+    cur->fds = fds;
+    cur->fd_cnt = cnt;
+  }
+  cur->fd_hint = fd + 1;
+  return fd;
+}
+
+/* Returns the current process's table slot for open file
+   descriptor FD, or a null pointer if FD is not open. */
+static struct fd *
+lookup_fd (int fd)
+{
+  struct thread *cur = thread_current ();
+  if (fd < 2 || fd >= cur->fd_cnt || cur->fds[fd].file == NULL) {
+    return NULL;
+  }
+  return &cur->fds[fd];
+}
+
 static int 
 syscall_open (const char *file) 
 {
-  if (!usermem_read ((uint8_t *)file, -1)) {
+  if (strlen_user (file) < 0) {
     syscall_exit (-1);
   }
   struct file *f = filesys_open (file);
   struct dir *d = filesys_open_dir (file);
-  struct fd *fd_struct;
+  int fd;
   if (f == NULL && d == NULL) {
     return -1;
+  } else if ((fd = alloc_fd ()) == -1) {
+    file_close (f);
+    dir_close (d);
+    return -1;
   } else if (f != NULL) {
-    fd_struct = malloc (sizeof(struct fd));
-    fd_struct->file = f;
-    fd_struct->is_dir = false;
-  } else if (d != NULL) {
-    fd_struct = malloc (sizeof(struct fd));
-    fd_struct->dir = d;
-    fd_struct->is_dir = true;
+    thread_current ()->fds[fd].file = f;
+    thread_current ()->fds[fd].is_dir = false;
+  } else {
+    thread_current ()->fds[fd].dir = d;
+    thread_current ()->fds[fd].is_dir = true;
   }
-  fd_struct->fd = thread_current ()->next_fd;
-  (thread_current ()->next_fd)++;
-  list_push_back (&(thread_current ()->open_files), &(fd_struct->elem));
-  return fd_struct->fd;
+  return fd;
 }
 
 static struct file *
 get_file (int fd) 
 {
-  struct list_elem *e;
-  for (e = list_begin (&(thread_current ()->open_files)); 
-       e != list_end (&(thread_current ()->open_files)); e = list_next (e)) 
-    { 
-      struct fd *current = list_entry (e, struct fd, elem);
-      if (current->fd == fd && current->is_dir == false) {
-        return current->file;
-    }
+  struct fd *current = lookup_fd (fd);
+  if (current == NULL || current->is_dir) {
+    return NULL;
   }
-  return NULL;
+  return current->file;
 }
 
 static int 
@@ -394,44 +355,39 @@ syscall_filesize (int fd)
   return (int) file_length (f);
 }
 
+/* Reads keyboard input into the user's BUFFER a chunk at a time.
+   The file system instead reads straight into BUFFER, whose pages
+   are checked up front, so it copies each cache block to user
+   memory without an intermediate kernel buffer. */
 static int 
 syscall_read (int fd, void *buffer, unsigned length)
 {
-  char *buf = malloc (length);
-  struct file *f = get_file (fd);
   if (fd == 0) {
-    int i = 0;
-    for (i = 0; i < length; i++) {
-      buf[i] = input_getc ();
-    }
-    bool success = usermem_write (buffer, buf, length);
-    if (success) {
-      free (buf);
-      return length;
-    } else {
-      free (buf);
-      syscall_exit (-1);
+    uint8_t chunk[64];
+    unsigned done, i;
+    for (done = 0; done < length; done += i) {
+      for (i = 0; i < sizeof chunk && done + i < length; i++) {
+        chunk[i] = input_getc ();
+      }
+      if (!copy_to_user ((uint8_t *) buffer + done, chunk, i))
+        syscall_exit (-1);
     }
-  } else if (f == NULL) {
-    free (buf);
+    return length;
+  }
+  if (!user_range_ok (buffer, length, true))
+    syscall_exit (-1);
+  struct file *f = get_file (fd);
+  if (f == NULL) {
     return -1;
   } else {
-    off_t len = file_read (f, buf, (off_t)length);
-    bool success = usermem_write (buffer, buf, len);
-    if (success) {
-      free (buf);
-      return len;
-    } else {
-      free (buf);
-      syscall_exit (-1);
-    }
+    return file_read (f, buffer, (off_t)length);
   }
 }
 
 static int 
 syscall_write (int fd, const void *buffer, unsigned length)
 {
-  if (!usermem_read (buffer, length))
+  if (!user_range_ok (buffer, length, false))
     syscall_exit (-1);
   struct file *f = get_file (fd);
   if (fd == 1) {
@@ -467,22 +423,19 @@ syscall_tell (int fd)
 static void 
 syscall_close (int fd)
 {
-  struct list_elem *e;
-  for (e = list_begin (&(thread_current ()->open_files)); 
-       e != list_end (&(thread_current ()->open_files)); e = list_next (e)) 
-    { 
-      struct fd *current = list_entry (e, struct fd, elem);
-      if (current->fd == fd) {
-        list_remove(&(current->elem));
-        if (current->is_dir) {
-          dir_close (current->dir);
-        } else {
-          file_close (current->file);
-        }
-        free (current);
-        return;
-      }
-    }
+  struct fd *current = lookup_fd (fd);
+  if (current == NULL) {
+    return;
+  }
+  if (current->is_dir) {
+    dir_close (current->dir);
+  } else {
+    file_close (current->file);
+  }
+  current->file = NULL;
+  if (fd < thread_current ()->fd_hint) {
+    thread_current ()->fd_hint = fd;
+  }
 }
 
 static int 
@@ -497,7 +450,7 @@ syscall_practice (int i)
    if successful, false on failure. */
 static bool 
 syscall_chdir (const char *name)  {
-  if (!usermem_read ((uint8_t *)name, -1)) {
+  if (strlen_user (name) < 0) {
     syscall_exit (-1);
   }
   struct dir *old_cwd = thread_current ()->cwd;
@@ -514,7 +467,7 @@ syscall_chdir (const char *name)  {
    exists and /a/b/c does not. */
 static bool
 syscall_mkdir (const char *dir) {  
-  if (!usermem_read ((uint8_t *)dir, -1)) {
+  if (strlen_user (dir) < 0) {
     syscall_exit (-1);
   }
   return filesys_mkdir (dir);
@@ -529,60 +482,40 @@ syscall_mkdir (const char *dir) {
    . and .. should not be returned by readdir */
 static bool
 syscall_readdir (int fd, char *name) {
-  if (!usermem_read ((uint8_t *)name, -1)) {
-    syscall_exit (-1);
+  char kname[READDIR_MAX_LEN + 1];
+  struct fd *pfd = lookup_fd (fd);
+  if (pfd == NULL || pfd->is_dir == false) {
+    return false;
   }
-  struct thread *cur = thread_current ();
-  struct list_elem *el;
-  struct fd *pfd;
-  for (el = list_begin (&cur->open_files); el != list_end (&cur->open_files); 
-       el = list_next (el)) {
-    pfd = list_entry (el, struct fd, elem);
-    if (pfd->fd == fd) {
-      if (pfd->is_dir == false) {
-        return false;
-      }
-      return dir_readdir (pfd->dir, name);
-    }
+  if (!dir_readdir (pfd->dir, kname)) {
+    return false;
   }
-  return false;
+  if (!copy_to_user (name, kname, strlen (kname) + 1)) {
+    syscall_exit (-1);
+  }
+  return true;
 }
 
 /*  Returns true if fd represents a directory, false if 
     it represents an ordinary file. */
 static bool
 syscall_isdir (int fd) {
-  struct thread *cur = thread_current ();
-  struct list_elem *el;
-  struct fd *pfd;
-  for (el = list_begin (&cur->open_files); el != list_end (&cur->open_files); 
-       el = list_next (el)) {
-    pfd = list_entry (el, struct fd, elem);
-    if (pfd->fd == fd)
-      return pfd->is_dir;
-  }
-  return false;
+  struct fd *pfd = lookup_fd (fd);
+  return pfd != NULL && pfd->is_dir;
 }
 
 /* Returns the inode number of the inode associated with fd, 
    which may represent an ordinary file or a directory */
 static int
 syscall_inumber (int fd) {
-  struct thread *cur = thread_current ();
-  struct list_elem *el;
-  struct fd *pfd;
-  for (el = list_begin (&cur->open_files); el != list_end (&cur->open_files); 
-       el = list_next (el)) {
-    pfd = list_entry (el, struct fd, elem);
-    if (pfd->fd == fd) {
-      if (pfd->is_dir) {
-        return inode_get_inumber (dir_get_inode (pfd->dir));
-      } else {
-        return inode_get_inumber (file_get_inode (pfd->file));
-      }
-    }
+  struct fd *pfd = lookup_fd (fd);
+  if (pfd == NULL) {
+    return -1;
+  } else if (pfd->is_dir) {
+    return inode_get_inumber (dir_get_inode (pfd->dir));
+  } else {
+    return inode_get_inumber (file_get_inode (pfd->file));
   }
-  return -1; 
 }
 
 static unsigned long long 
@@ -599,3 +532,14 @@ static void
 syscall_buffer_clear (void) {
   buffer_clear ();
 }
+
+/* Returns the number of runs of contiguous disk sectors that hold
+   the file open as fd, or -1 if fd is not an open file */
+static int
+syscall_get_fragment_cnt (int fd) {
+  struct file *f;
+  if ((f = get_file (fd)) == NULL) {
+    return -1;
+  }
+  return (int) inode_fragment_cnt (file_get_inode (f));
+}
@@ -0,0 +1,141 @@
+#include "userprog/uaccess.h"
+#include <stdint.h>
+#include "threads/interrupt.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "userprog/pagedir.h"
+
+/* The kernel reads and writes user memory through the functions
+   in this file.  Each instruction in them that may fault on a bad
+   user address is listed in the fixup table, a linker section of
+   (instruction, fixup) address pairs.  If it faults, page_fault()
+   resumes at the fixup address instead of panicking, and the
+   function reports failure.  A copy thus costs a range check and
+   the copy itself, not a probe per byte. */
+
+/* An entry in the fixup table. */
+struct fixup
+  {
+    uintptr_t insn;             /* Instruction that may fault. */
+    uintptr_t fixup;            /* Where to resume if it does. */
+  };
+
+/* The fixup table, gathered by the linker script. */
+extern const struct fixup _start_fixups[], _end_fixups[];
+
+/* Returns true if the SIZE bytes at UADDR lie below PHYS_BASE,
+   so that faults are the only way an access to them can fail. */
+static bool
+is_user_range (const void *uaddr, size_t size)
+{
+  uintptr_t start = (uintptr_t) uaddr;
+
+  return start + size >= start && start + size <= (uintptr_t) PHYS_BASE;
+}
+
+/* Copies SIZE bytes from SRC to DST, either of which may be a
+   user address.  Returns the number of bytes left uncopied
+   because of a fault. */
+static size_t
+copy (void *dst, const void *src, size_t size)
+{
+  asm volatile ("1: rep movsb\n"
+                "2:\n"
+                ".pushsection .fixups, \"a\"\n"
+                ".balign 4\n"
+                ".long 1b, 2b\n"
+                ".popsection"
+                : "+D" (dst), "+S" (src), "+c" (size) : : "memory");
+  return size;
+}
+
+/* Copies SIZE bytes from user address USRC to kernel address DST.
+   Returns false if they are not all in mapped user memory. */
+bool
+copy_from_user (void *dst, const void *usrc, size_t size)
+{
+  return is_user_range (usrc, size) && copy (dst, usrc, size) == 0;
+}
+
+/* Copies SIZE bytes from kernel address SRC to user address UDST.
+   Returns false if they are not all in mapped, writable user
+   memory. */
+bool
+copy_to_user (void *udst, const void *src, size_t size)
+{
+  return is_user_range (udst, size) && copy (udst, src, size) == 0;
+}
+
+/* Returns the length of the null-terminated string at user
+   address USTR, or -1 if the string is not wholly in mapped user
+   memory.  Scans up to a page at a time. */
+int
+strlen_user (const char *ustr)
+{
+  const char *p = ustr;
+
+  while (is_user_vaddr (p))
+    {
+      size_t left = PGSIZE - pg_ofs (p);
+      bool found = false;
+      bool faulted = false;
+
+      asm volatile ("1: repne scasb\n"
+                    "   sete %[found]\n"
+                    "   jmp 3f\n"
+                    "2: movb $1, %[faulted]\n"
+                    "3:\n"
+                    ".pushsection .fixups, \"a\"\n"
+                    ".balign 4\n"
+                    ".long 1b, 2b\n"
+                    ".popsection"
+                    : "+D" (p), "+c" (left),
+                      [found] "+qm" (found), [faulted] "+qm" (faulted)
+                    : "a" (0) : "cc", "memory");
+      if (faulted)
+        return -1;
+      if (found)
+        return p - ustr - 1;
+    }
+  return -1;
+}
+
+/* Returns true if the SIZE bytes at user address UADDR all lie in
+   pages mapped for the current process, and writable ones if
+   WRITABLE is true, so that the kernel may copy to or from them
+   directly.  Looks up each page once, not each byte. */
+bool
+user_range_ok (const void *uaddr, size_t size, bool writable)
+{
+  uint32_t *pd = thread_current ()->pagedir;
+  const uint8_t *start = uaddr;
+  const uint8_t *end = start + size;
+  const uint8_t *page;
+
+  if (size == 0)
+    return true;
+  if (!is_user_range (uaddr, size))
+    return false;
+  for (page = pg_round_down (start); page < end; page += PGSIZE)
+    if (pagedir_get_page (pd, page) == NULL
+        || (writable && !pagedir_is_writable (pd, page)))
+      return false;
+  return true;
+}
+
+/* If F is a page fault in one of the instructions in the fixup
+   table, makes F resume at that instruction's fixup address and
+   returns true.  Otherwise returns false. */
+bool
+uaccess_fixup (struct intr_frame *f)
+{
+  const struct fixup *e;
+
+  for (e = _start_fixups; e < _end_fixups; e++)
+    if (e->insn == (uintptr_t) f->eip)
+      {
+        f->eip = (void (*) (void)) e->fixup;
+        return true;
+      }
+  return false;
+}